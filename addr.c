@@ -0,0 +1,240 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * Address keys. Every table in connbal is keyed on uint32_t addresses, and a
+ * v4-only capture should cost no more than it used to, so rather than widen
+ * all the keys to 128 bits we intern the IPv6 addresses we care about:
+ *
+ *  - an IPv4 address is its own key;
+ *  - an IPv6 address is looked up by its full 128 bits (IPv4-mapped ones,
+ *    ::ffff:a.b.c.d, are turned back into the IPv4 key) and given the next
+ *    key from ADDR_V6BASE up.
+ *
+ * The table of interned addresses only ever grows, in fixed chunks that are
+ * never moved, so the daemon's query thread can format a key it got from a
+ * published snapshot while the parser carries on adding to it.
+ *
+ * So that DNS packets we end up ignoring can't grow it, the addresses of a
+ * DNS packet are first given tentative keys, from ADDR_TENTBASE up: a hash of
+ * the address into a small table, kept separately for sources and
+ * destinations. DNS-over-TCP streams are keyed on them, so a stream holds
+ * its keys (addr_hold()) until it goes; every other use of a tentative key
+ * is over by the end of its packet. An address gets the slot in a short
+ * window from its hash that's held for it already, or else the first one
+ * that isn't held at all, so two addresses never share a key while it's in
+ * use. Each half has a slot for every stream we'll track, so a window is
+ * only ever all held for other addresses by bad luck, and then the packet
+ * is ignored. parse_dns() resolves them to real keys, interning only the
+ * client and server of a query it's tracking, and so must do so while it
+ * still has the packet they came from.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "hash.h"
+#include "addr.h"
+
+#define	ADDR_CHUNK	4096
+#define	ADDR_MAXCHUNKS	((ADDR_TENTBASE - ADDR_V6BASE) / ADDR_CHUNK)
+#define	ADDR_NTENT	8192		/* half for sources, half dests */
+#define	ADDR_TENTPROBE	16		/* slots tried for each address */
+
+struct addr6 {
+	uint8_t a6_bytes[16];
+};
+
+static struct addr6 *addrchunks[ADDR_MAXCHUNKS];
+static uint32_t naddrs = 0;
+
+/* Open-addressed index from address to id + 1; at most half full. */
+static uint32_t *addrindex = NULL;
+static uint32_t addrindexsize = 0;
+
+struct tentslot {
+	struct addr6 ts_addr;
+	uint32_t ts_refs;		/* DNS-over-TCP streams holding it */
+};
+
+static struct tentslot tentative[ADDR_NTENT];
+
+static const uint8_t v4mapped[12] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+static struct addr6 *
+addr_get(uint32_t id)
+{
+	return (&addrchunks[id / ADDR_CHUNK][id % ADDR_CHUNK]);
+}
+
+static void
+addr_index(uint32_t id)
+{
+	uint32_t i, mask = addrindexsize - 1;
+
+	i = ahash(addr_get(id)->a6_bytes) & mask;
+	while (addrindex[i] != 0)
+		i = (i + 1) & mask;
+	addrindex[i] = id + 1;
+}
+
+/*
+ * Returns the key for the IPv6 address "a" (16 bytes, network order), adding
+ * it if "create" is set. Returns ADDR_NONE if it isn't known and "create"
+ * isn't set, or if we're out of keys.
+ */
+uint32_t
+addr_from6(const uint8_t *a, int create)
+{
+	uint32_t i, id, mask, v4;
+
+	if (memcmp(a, v4mapped, 12) == 0) {
+		memcpy(&v4, a + 12, 4);
+		v4 = ntohl(v4);
+		return (v4 >= ADDR_V6BASE ? ADDR_NONE : v4);
+	}
+
+	if (addrindexsize > 0) {
+		mask = addrindexsize - 1;
+		i = ahash(a) & mask;
+		while (addrindex[i] != 0) {
+			id = addrindex[i] - 1;
+			if (memcmp(addr_get(id)->a6_bytes, a, 16) == 0)
+				return (ADDR_V6BASE + id);
+			i = (i + 1) & mask;
+		}
+	}
+	if (!create)
+		return (ADDR_NONE);
+
+	id = naddrs;
+	if (id / ADDR_CHUNK >= ADDR_MAXCHUNKS) {
+		fprintf(stderr, "warning: too many IPv6 addresses\n");
+		return (ADDR_NONE);
+	}
+	if (id % ADDR_CHUNK == 0) {
+		addrchunks[id / ADDR_CHUNK] = malloc(
+		    ADDR_CHUNK * sizeof (struct addr6));
+	}
+	memcpy(addr_get(id)->a6_bytes, a, 16);
+	naddrs++;
+
+	if (naddrs * 2 > addrindexsize) {
+		free(addrindex);
+		addrindexsize = (addrindexsize == 0) ? 1024 :
+		    addrindexsize * 2;
+		addrindex = calloc(addrindexsize, sizeof (*addrindex));
+		for (i = 0; i < naddrs; ++i)
+			addr_index(i);
+	} else {
+		addr_index(id);
+	}
+	return (ADDR_V6BASE + id);
+}
+
+/*
+ * Returns the tentative key for the IPv6 address "a", which is the source of
+ * its packet, or the destination if "dst" is set. IPv4-mapped addresses get
+ * their IPv4 key, as in addr_from6(). Returns ADDR_NONE if every slot "a"
+ * could go in is held for another address.
+ */
+uint32_t
+addr_tentative(const uint8_t *a, int dst)
+{
+	uint32_t h, i, j, base, v4;
+	int avail = -1;
+	struct tentslot *ts;
+
+	if (memcmp(a, v4mapped, 12) == 0) {
+		memcpy(&v4, a + 12, 4);
+		v4 = ntohl(v4);
+		return (v4 >= ADDR_V6BASE ? ADDR_NONE : v4);
+	}
+	base = dst ? ADDR_NTENT / 2 : 0;
+	h = ahash(a);
+	for (j = 0; j < ADDR_TENTPROBE; ++j) {
+		i = base + ((h + j) & (ADDR_NTENT / 2 - 1));
+		ts = &tentative[i];
+		if (ts->ts_refs == 0) {
+			if (avail == -1)
+				avail = i;
+		} else if (memcmp(ts->ts_addr.a6_bytes, a, 16) == 0) {
+			return (ADDR_TENTBASE + i);
+		}
+	}
+	if (avail == -1)
+		return (ADDR_NONE);
+	ts = &tentative[avail];
+	memcpy(ts->ts_addr.a6_bytes, a, 16);
+	return (ADDR_TENTBASE + avail);
+}
+
+/*
+ * Keep a tentative key from being given to another address until the
+ * matching addr_release(). Any other key is left alone.
+ */
+void
+addr_hold(uint32_t key)
+{
+	if (key >= ADDR_TENTBASE && key < ADDR_TENTBASE + ADDR_NTENT)
+		tentative[key - ADDR_TENTBASE].ts_refs++;
+}
+
+void
+addr_release(uint32_t key)
+{
+	if (key >= ADDR_TENTBASE && key < ADDR_TENTBASE + ADDR_NTENT)
+		tentative[key - ADDR_TENTBASE].ts_refs--;
+}
+
+/*
+ * Turn a tentative key from the packet being parsed into a real one, adding
+ * the address if "create" is set, as addr_from6() does. Any other key is
+ * returned as it is.
+ */
+uint32_t
+addr_resolve(uint32_t key, int create)
+{
+	if (key < ADDR_TENTBASE || key >= ADDR_TENTBASE + ADDR_NTENT)
+		return (key);
+	return (addr_from6(tentative[key - ADDR_TENTBASE].ts_addr.a6_bytes,
+	    create));
+}
+
+/*
+ * Format an address key for output: IPv4 addresses zero-padded, as connbal
+ * has always printed them, and IPv6 ones in the usual compressed form.
+ */
+const char *
+addr_fmt(uint32_t key, char *buf)
+{
+	const struct addr6 *a;
+	uint8_t b[4];
+
+	if (addr_is_v6(key)) {
+		if (key >= ADDR_TENTBASE)
+			a = &tentative[key - ADDR_TENTBASE].ts_addr;
+		else
+			a = addr_get(key - ADDR_V6BASE);
+		if (inet_ntop(AF_INET6, a->a6_bytes, buf, ADDR_STRLEN) == NULL)
+			strlcpy(buf, "?", ADDR_STRLEN);
+		return (buf);
+	}
+	memcpy(b, &key, 4);
+	snprintf(buf, ADDR_STRLEN, "%03u.%03u.%03u.%03u",
+	    b[3], b[2], b[1], b[0]);
+	return (buf);
+}
@@ -0,0 +1,41 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+#if !defined(_ADDR_H)
+#define _ADDR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Addresses are keyed everywhere by a uint32_t. An IPv4 address is its own
+ * key, and IPv6 addresses are given keys in 240.0.0.0/4 (the reserved "class
+ * E" range, which never appears on the wire) as they're first seen. The top
+ * of that range is kept for the tentative keys of DNS packets. See addr.c.
+ */
+#define	ADDR_V6BASE	0xF0000000U
+#define	ADDR_TENTBASE	0xFFFFC000U
+#define	ADDR_NONE	0xFFFFFFFFU
+
+/* Long enough for any address as printed by addr_fmt(). */
+#define	ADDR_STRLEN	46
+
+static inline int
+addr_is_v6(uint32_t key)
+{
+	return (key >= ADDR_V6BASE && key != ADDR_NONE);
+}
+
+uint32_t addr_from6(const uint8_t *a, int create);
+uint32_t addr_tentative(const uint8_t *a, int dst);
+uint32_t addr_resolve(uint32_t key, int create);
+void addr_hold(uint32_t key);
+void addr_release(uint32_t key);
+const char *addr_fmt(uint32_t key, char *buf);
+
+#endif
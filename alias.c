@@ -0,0 +1,123 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * CNAME alias cache. Services often sit behind a CNAME (into a CNS name, say),
+ * and the address records then belong to the end of the chain rather than
+ * the name the client looked up or the SRV target it was given. For every
+ * CNAME we see we remember which name the chain started from (its "head"),
+ * for as long as the CNAME's TTL, so that address records for a canonical
+ * name can be traced back even when the chain itself isn't in the same
+ * response.
+ *
+ * The cache holds at most ALIAS_MAX names; when it's full, new chains are
+ * only followed within the response they arrive in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+#include "packet.h"
+#include "client.h"
+
+#define	ALIAS_MAX	4096
+
+struct alias {
+	struct alias *next;
+	struct client *client;		/* whose answer it last came from */
+	uint32_t stamp;			/* hdr.sec when it was last seen */
+	uint32_t ttl;
+	char target[256];
+	char head[256];
+};
+/*
+ * All cached aliases, hashed on target name.
+ */
+struct alias *aliases[BUCKETS] = { NULL };
+static int nalias = 0;
+
+/*
+ * Remember that "target" is an alias (at some depth) of "head", from an
+ * answer to client "c", which pays for it from now on if it can.
+ */
+void
+alias_add(struct client *c, const char *target, const char *head,
+    uint32_t time, uint32_t ttl)
+{
+	int h;
+	struct alias *a;
+
+	if (strcmp(target, head) == 0)
+		return;
+	h = shash(target);
+	for (a = aliases[h]; a != NULL; a = a->next) {
+		if (strcmp(a->target, target) == 0)
+			break;
+	}
+	if (a == NULL) {
+		if (nalias >= ALIAS_MAX)
+			return;
+		if (client_charge(c, sizeof (*a)) != 0)
+			return;
+		a = calloc(sizeof (*a), 1);
+		a->client = c;
+		strlcpy(a->target, target, sizeof (a->target));
+		a->next = aliases[h];
+		aliases[h] = a;
+		nalias++;
+	} else if (a->client != c && client_charge(c, sizeof (*a)) == 0) {
+		client_release(a->client, sizeof (*a));
+		a->client = c;
+	}
+	strlcpy(a->head, head, sizeof (a->head));
+	a->stamp = time;
+	a->ttl = ttl;
+}
+
+/*
+ * Returns the name the chain leading to "target" started from, or NULL if
+ * we don't know of (or no longer trust) one.
+ */
+const char *
+alias_head(const char *target, uint32_t time)
+{
+	int h;
+	struct alias *a;
+
+	h = shash(target);
+	for (a = aliases[h]; a != NULL; a = a->next) {
+		if (strcmp(a->target, target) == 0)
+			return (time - a->stamp < a->ttl ? a->head : NULL);
+	}
+	return (NULL);
+}
+
+/* Clean out aliases whose TTL has run out. */
+void
+clean_aliases(uint32_t time)
+{
+	int h;
+	struct alias *a, **pa;
+
+	for (h = 0; h < BUCKETS; ++h) {
+		pa = &aliases[h];
+		while ((a = *pa) != NULL) {
+			if (time - a->stamp >= a->ttl) {
+				*pa = a->next;
+				client_release(a->client, sizeof (*a));
+				free(a);
+				nalias--;
+			} else {
+				pa = &a->next;
+			}
+		}
+	}
+}
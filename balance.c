@@ -0,0 +1,231 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * Balance-quality metrics per service (-b). A service is a (client, name)
+ * pair, and its backends are the struct backends created for that name.
+ * Backends of the other address family from the client (AAAA answers to a
+ * client asking over IPv4, say) can't be matched to its connections, which
+ * come from its other address, so they're only counted, not balanced over.
+ *
+ * Everything here is kept as running sums that packet.c updates as each
+ * connection or DNS answer comes in, so that producing the report doesn't
+ * need another pass over the backends. For backend i with c_i connections,
+ * returned r_i times in DNS, out of n backends, C connections and R returns:
+ *
+ *	coefficient of variation = sqrt(sum(c_i^2) / n - (C / n)^2) / (C / n)
+ *	chi-square (uniform)	 = n * sum(c_i^2) / C - C
+ *	chi-square (DNS-weighted, E_i = C * r_i / R)
+ *				 = R / C * sum(c_i^2 / r_i) - C
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "addr.h"
+#include "hash.h"
+#include "packet.h"
+#include "client.h"
+
+struct service {
+	struct service *next;
+	struct service *cnext;		/* the client's next service */
+	uint32_t src;
+	uint32_t nbackends;		/* n */
+	uint32_t nused;			/* backends with c_i > 0 */
+	uint32_t nother;		/* other-family backends, not in n */
+	uint64_t conns;			/* C */
+	uint64_t returns;		/* R */
+	uint64_t maxconns;		/* max(c_i) */
+	uint64_t sumsq;			/* sum(c_i^2) */
+	double wsumsq;			/* sum(c_i^2 / r_i) */
+	uint32_t *bids;			/* its backend ids, for the shares */
+	uint32_t bidsize;
+	char name[256];
+};
+/*
+ * All services with at least one backend, hashed on src,name.
+ */
+struct service *services[BUCKETS] = { NULL };
+
+/*
+ * Returns the service for (src, name), adding it if it's new. Returns NULL
+ * if the client is over its quota.
+ */
+struct service *
+svc_find(uint32_t src, const char *name)
+{
+	int h;
+	struct service *s;
+	struct client *c;
+
+	h = nhash(src, name);
+	for (s = services[h]; s != NULL; s = s->next) {
+		if (s->src == src && strcmp(s->name, name) == 0)
+			return (s);
+	}
+
+	c = client_find(src, 1);
+	if (client_charge(c, sizeof (*s)) != 0)
+		return (NULL);
+	s = calloc(sizeof (*s), 1);
+	s->src = src;
+	strlcpy(s->name, name, sizeof (s->name));
+	s->next = services[h];
+	services[h] = s;
+	s->cnext = c->c_svcs;
+	c->c_svcs = s;
+	c->c_nsvcs++;
+	return (s);
+}
+
+/*
+ * A new backend of this service, "id", was returned in DNS for the first
+ * time. Returns -1 if we're out of memory for it.
+ */
+int
+svc_add_backend(struct service *s, uint32_t id, uint64_t r)
+{
+	uint32_t *nbids, nsize;
+
+	if (s->nbackends == s->bidsize) {
+		nsize = (s->bidsize == 0) ? 4 : s->bidsize * 2;
+		nbids = realloc(s->bids, nsize * sizeof (*nbids));
+		if (nbids == NULL)
+			return (-1);
+		s->bids = nbids;
+		s->bidsize = nsize;
+	}
+	s->bids[s->nbackends++] = id;
+	s->returns += r;
+	return (0);
+}
+
+/* A new backend of the other address family from the client. */
+void
+svc_other_family(struct service *s)
+{
+	s->nother++;
+}
+
+/* A backend with "c" connections so far, returned "r" times, got another. */
+void
+svc_conn(struct service *s, uint64_t c, uint64_t r)
+{
+	if (c == 0)
+		s->nused++;
+	s->conns++;
+	s->sumsq += 2 * c + 1;
+	s->wsumsq += (double)(2 * c + 1) / r;
+	if (c + 1 > s->maxconns)
+		s->maxconns = c + 1;
+}
+
+/* A backend with "c" connections was returned in DNS again. */
+void
+svc_returned(struct service *s, uint64_t c, uint64_t oldr, uint64_t newr)
+{
+	s->returns += newr - oldr;
+	if (c > 0)
+		s->wsumsq += (double)(c * c) / newr - (double)(c * c) / oldr;
+}
+
+static double
+svc_cv(const struct service *s)
+{
+	double mean, var;
+
+	if (s->nbackends < 2 || s->conns == 0)
+		return (0.0);
+	mean = (double)s->conns / s->nbackends;
+	var = (double)s->sumsq / s->nbackends - mean * mean;
+	if (var < 0.0)
+		var = 0.0;
+	return (sqrt(var) / mean);
+}
+
+static int
+svc_cmp(const void *a, const void *b)
+{
+	double ca = svc_cv(*(struct service * const *)a);
+	double cb = svc_cv(*(struct service * const *)b);
+
+	if (ca < cb)
+		return (1);
+	if (ca > cb)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Print one line per service (or only those of "client", unless it's
+ * ADDR_NONE), most unevenly balanced first.
+ */
+void
+print_balance_summary(FILE *out, uint32_t client)
+{
+	int h, i, n = 0;
+	struct service *s, **list;
+	struct client *c = NULL;
+
+	if (client != ADDR_NONE) {
+		if ((c = client_find(client, 0)) != NULL)
+			n = c->c_nsvcs;
+	} else {
+		for (h = 0; h < BUCKETS; ++h) {
+			for (s = services[h]; s != NULL; s = s->next)
+				++n;
+		}
+	}
+	list = calloc(n + 1, sizeof (*list));
+	n = 0;
+	if (c != NULL) {
+		for (s = c->c_svcs; s != NULL; s = s->cnext)
+			list[n++] = s;
+	} else if (client == ADDR_NONE) {
+		for (h = 0; h < BUCKETS; ++h) {
+			for (s = services[h]; s != NULL; s = s->next)
+				list[n++] = s;
+		}
+	}
+	qsort(list, n, sizeof (*list), svc_cmp);
+
+	fprintf(out, "# client\t#backends\t#other family\t#conns\tmax share\t"
+	    "%%unused\tcv\tchi2 uniform\tchi2 dns\tshares\tdns name\n");
+	for (i = 0; i < n; ++i) {
+		char srcs[ADDR_STRLEN];
+		double c;
+		uint32_t j;
+
+		s = list[i];
+		fprintf(out, "%s\t%u\t%u\t%llu\t", addr_fmt(s->src, srcs),
+		    s->nbackends, s->nother, (unsigned long long)s->conns);
+		if (s->conns == 0) {
+			fprintf(out, "-\t%s\t-\t-\t-\t-\t%s\n",
+			    (s->nbackends > 0) ? "100.0" : "-", s->name);
+			continue;
+		}
+		c = (double)s->conns;
+		fprintf(out, "%.1f\t%.1f\t%.3f\t%.1f\t%.1f\t",
+		    100.0 * s->maxconns / c,
+		    100.0 * (s->nbackends - s->nused) / s->nbackends,
+		    svc_cv(s),
+		    s->nbackends * (double)s->sumsq / c - c,
+		    (double)s->returns / c * s->wsumsq - c);
+		/* Each backend's share, in the order they were first seen. */
+		for (j = 0; j < s->nbackends; ++j) {
+			fprintf(out, "%s%.1f", (j == 0) ? "" : ",",
+			    100.0 * backend_conns(s->bids[j]) / c);
+		}
+		fprintf(out, "\t%s\n", s->name);
+	}
+	free(list);
+}
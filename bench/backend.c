@@ -0,0 +1,107 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * Microbenchmark for the backend table: times make_backend() for "backends"
+ * backends (from 1000 clients, looking up 50 names), then got_tcp_syn() on
+ * "syns" of them picked at random, then print_summary() to /dev/null, and
+ * reports the peak RSS.
+ *
+ * Usage: bench/backend [backends [syns]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "../addr.h"
+#include "../packet.h"
+
+#define	NBACKENDS	100000
+#define	NSYNS		1000000
+#define	NCLIENTS	1000
+#define	NNAMES		50
+
+/* connbal.c's options, all off. */
+const char *namefilt = NULL;
+int ttlstats = 0;
+int balstats = 0;
+int daemonmode = 0;
+int lossreport = 0;
+int gotint = 0;
+int gottick = 0;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nb = NBACKENDS, ns = NSYNS;
+	int i;
+	uint32_t k, *srcs, *dsts;
+	char name[64];
+	double t0, t1, t2, t3;
+	struct rusage ru;
+	FILE *null;
+
+	if (argc > 1)
+		nb = atoi(argv[1]);
+	if (argc > 2)
+		ns = atoi(argv[2]);
+	if (nb < 1 || ns < 0) {
+		fprintf(stderr, "usage: bench/backend [backends [syns]]\n");
+		return (1);
+	}
+	if ((srcs = malloc(ns * sizeof (*srcs))) == NULL ||
+	    (dsts = malloc(ns * sizeof (*dsts))) == NULL ||
+	    (null = fopen("/dev/null", "w")) == NULL) {
+		perror("bench/backend");
+		return (1);
+	}
+
+	t0 = now();
+	for (i = 0; i < nb; ++i) {
+		snprintf(name, sizeof (name), "svc%d.example.com.",
+		    (i % NCLIENTS) % NNAMES);
+		make_backend(0x0a000000 | (i % NCLIENTS), 0xac100000 + i,
+		    name, NULL, 1000);
+	}
+	t1 = now();
+
+	/* Pick the SYNs' backends up front, so we time only the lookups. */
+	srand(1);
+	for (i = 0; i < ns; ++i) {
+		k = ((uint32_t)rand() * 2654435761U) % nb;
+		srcs[i] = 0x0a000000 | (k % NCLIENTS);
+		dsts[i] = 0xac100000 + k;
+	}
+	t2 = now();
+	for (i = 0; i < ns; ++i)
+		got_tcp_syn(srcs[i], dsts[i], 40000, 443, 1000 + i / 100000);
+	t3 = now();
+
+	print_summary(null, ADDR_NONE);
+	fflush(null);
+
+	printf("%d backends  %6.0f ns/backend\n", nb, (t1 - t0) / nb * 1e9);
+	printf("%d syns  %6.0f ns/syn\n", ns,
+	    ns > 0 ? (t3 - t2) / ns * 1e9 : 0.0);
+	printf("summary  %6.2f s\n", now() - t3);
+	getrusage(RUSAGE_SELF, &ru);
+	printf("max rss  %6ld MB\n", ru.ru_maxrss / 1024);
+	return (0);
+}
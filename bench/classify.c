@@ -0,0 +1,149 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * Microbenchmark for batch_classify(): times each classifier this CPU has
+ * against the scalar one, on batches of synthetic frames (a mix of DNS over
+ * UDP and TCP, SYNs, other TCP, other UDP and non-IP), and checks that they
+ * all agree. batch_gather() does most of the per-record work and is the same
+ * for all of them, so each is timed both alone and together with it.
+ *
+ * Usage: bench/classify [batches]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../enums.h"
+#include "../classify.h"
+
+#define	NFRAMES		4096
+#define	FRAMELEN	64
+#define	ROUNDS		2000
+
+static uint8_t frames[NFRAMES][FRAMELEN];
+static struct batch batches[NFRAMES / BATCH_MAX];
+static uint64_t results[NFRAMES / BATCH_MAX][5];
+
+static const char *impls[] = { "scalar", "sse2", "avx2" };
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Kinds of frame: 0 DNS/UDP, 1 DNS/TCP SYN, 2 SYN, 3 UDP, 4 ARP, 5 TCP ACK
+ * (some with FIN).
+ */
+static void
+make_frame(uint8_t *f, int kind)
+{
+	uint16_t v;
+
+	memset(f, 0, FRAMELEN);
+	v = htons(kind == 4 ? 0x0806 : MAC_IP4);
+	memcpy(f + 12, &v, 2);
+	f[14] = 0x45;
+	f[23] = (kind == 0 || kind == 3) ? PR_UDP : PR_TCP;
+	v = htons(kind == 0 || kind == 1 ? 53 : 40000 + (rand() % 1000));
+	memcpy(f + 36, &v, 2);
+	v = htons(443);
+	memcpy(f + 34, &v, 2);
+	f[47] = (kind == 1 || kind == 2) ? TCPFL_SYN :
+	    TCPFL_ACK | ((rand() % 8 == 0) ? TCPFL_FIN : 0);
+}
+
+static void
+save(const struct batch *b, uint64_t *r)
+{
+	r[0] = b->b_dns;
+	r[1] = b->b_dnstcp;
+	r[2] = b->b_syn;
+	r[3] = b->b_tcp;
+	r[4] = b->b_finrst;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nb = NFRAMES / BATCH_MAX;
+	int i, j, k, rounds = ROUNDS;
+	uint64_t r[5];
+	double t0, t1, tg, base = 0.0, tbase = 0.0;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+
+	srand(1);
+	for (i = 0; i < NFRAMES; ++i)
+		make_frame(frames[i], rand() % 6);
+	for (i = 0; i < nb; ++i) {
+		struct batch *b = &batches[i];
+		b->b_count = BATCH_MAX;
+		for (j = 0; j < BATCH_MAX; ++j) {
+			b->b_data[j] = frames[i * BATCH_MAX + j];
+			b->b_hdr[j].snap = FRAMELEN;
+		}
+		batch_gather(b);
+	}
+
+	t0 = now();
+	for (j = 0; j < rounds; ++j) {
+		for (i = 0; i < nb; ++i)
+			batch_gather(&batches[i]);
+	}
+	tg = (now() - t0) / ((double)rounds * nb) * 1e9;
+	printf("gather   %7.1f ns/batch  %5.2f ns/record\n", tg,
+	    tg / BATCH_MAX);
+
+	for (k = 0; k < (int)(sizeof (impls) / sizeof (impls[0])); ++k) {
+		if (classify_select(impls[k]) != 0) {
+			printf("%-8s not supported\n", impls[k]);
+			continue;
+		}
+		for (i = 0; i < nb; ++i) {
+			batch_classify(&batches[i]);
+			if (k == 0) {
+				save(&batches[i], results[i]);
+				continue;
+			}
+			save(&batches[i], r);
+			if (memcmp(r, results[i], sizeof (r)) != 0) {
+				fprintf(stderr, "%s disagrees with scalar on "
+				    "batch %d\n", impls[k], i);
+				return (1);
+			}
+		}
+
+		t0 = now();
+		for (j = 0; j < rounds; ++j) {
+			for (i = 0; i < nb; ++i)
+				batch_classify(&batches[i]);
+		}
+		t1 = now();
+		t1 = (t1 - t0) / ((double)rounds * nb) * 1e9;
+		if (k == 0) {
+			base = t1;
+			tbase = tg + t1;
+		}
+		printf("%-8s %7.1f ns/batch  %5.2f ns/record  %4.1fx  "
+		    "with gather %5.2f ns/record  %4.1fx\n",
+		    impls[k], t1, t1 / BATCH_MAX, base / t1,
+		    (tg + t1) / BATCH_MAX, tbase / (tg + t1));
+	}
+	return (0);
+}
@@ -0,0 +1,362 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "enums.h"
+#include "classify.h"
+#include "addr.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define	CLASSIFY_X86
+#include <immintrin.h>
+#endif
+
+static void classify_scalar(struct batch *b);
+static void (*classify_fn)(struct batch *) = classify_scalar;
+
+const char *classify_impl = "scalar";
+
+/*
+ * Skip the IPv6 header and any extension headers after it. Returns the offset
+ * of the upper-layer header and sets *proto to its type, or returns -1 if we
+ * can't get to it (including for any fragment but the first).
+ */
+static int
+skip_ip6(const uint8_t *data, int off, int snap, uint16_t *proto)
+{
+	uint8_t nh = data[off + 6];
+	uint16_t v;
+	int n;
+
+	off += 40;
+	for (n = 0; n < 8; ++n) {
+		switch (nh) {
+		case PR_HOPOPT:
+		case PR_ROUTING:
+		case PR_DSTOPTS:
+			if (snap < off + 8)
+				return (-1);
+			nh = data[off];
+			off += (data[off + 1] + 1) * 8;
+			break;
+		case PR_AH:
+			if (snap < off + 8)
+				return (-1);
+			nh = data[off];
+			off += (data[off + 1] + 2) * 4;
+			break;
+		case PR_FRAGMENT:
+			if (snap < off + 8)
+				return (-1);
+			memcpy(&v, data + off + 2, 2);
+			if ((ntohs(v) & 0xfff8) != 0)
+				return (-1);
+			nh = data[off];
+			off += 8;
+			break;
+		default:
+			*proto = nh;
+			return (off);
+		}
+	}
+	return (-1);
+}
+
+/*
+ * Pull the fields we classify on out of each record in the batch. Offsets
+ * vary per record (VLAN tags, IP options, IPv6 extension headers) so this
+ * part stays scalar, but it only does arithmetic and loads -- all the
+ * decisions happen in batch_classify().
+ *
+ * b_src and b_dst are only filled in for IPv4: IPv6 addresses have to be
+ * turned into keys (see addr.c), which is only worth doing for the records
+ * we're interested in.
+ */
+void
+batch_gather(struct batch *b)
+{
+	int i, off, l4;
+	const uint8_t *data;
+	uint16_t v, iplen;
+	uint32_t snap;
+
+	for (i = 0; i < b->b_count; ++i) {
+		data = b->b_data[i];
+		snap = b->b_hdr[i].snap;
+		b->b_mactype[i] = 0;
+
+		/* Ethernet header, plus a possible 802.1Q tag. */
+		if (snap < 18)
+			continue;
+		memcpy(&v, data + 12, 2);
+		v = ntohs(v);
+		off = 14;
+		if (v == MAC_DOT1Q) {
+			memcpy(&v, data + 16, 2);
+			v = ntohs(v);
+			off += 4;
+		}
+
+		if (v == MAC_IP4) {
+			if (snap < (uint32_t)(off + 20))
+				continue;
+			l4 = off + (data[off] & 0x0f) * 4;
+			b->b_proto[i] = data[off + 9];
+			memcpy(&iplen, data + off + 2, 2);
+			b->b_iplen[i] = ntohs(iplen);
+			memcpy(&b->b_src[i], data + off + 12, 4);
+			b->b_src[i] = ntohl(b->b_src[i]);
+			memcpy(&b->b_dst[i], data + off + 16, 4);
+			b->b_dst[i] = ntohl(b->b_dst[i]);
+			/* Class E is where IPv6 keys live (see addr.h). */
+			if (b->b_src[i] >= ADDR_V6BASE ||
+			    b->b_dst[i] >= ADDR_V6BASE)
+				continue;
+		} else if (v == MAC_IP6) {
+			if (snap < (uint32_t)(off + 40))
+				continue;
+			l4 = skip_ip6(data, off, snap, &b->b_proto[i]);
+			if (l4 == -1)
+				continue;
+			/* The payload length doesn't count the fixed header. */
+			memcpy(&iplen, data + off + 4, 2);
+			b->b_iplen[i] = (uint32_t)ntohs(iplen) + 40;
+		} else {
+			continue;
+		}
+
+		/* Enough for the ports and TCP flags. */
+		if (snap < (uint32_t)(l4 + 14))
+			continue;
+
+		b->b_mactype[i] = v;
+		b->b_l3off[i] = off;
+		b->b_ipver[i] = data[off] >> 4;
+		b->b_l4off[i] = l4;
+		memcpy(&v, data + l4, 2);
+		b->b_sport[i] = ntohs(v);
+		memcpy(&v, data + l4 + 2, 2);
+		b->b_dport[i] = ntohs(v);
+		b->b_tcpfl[i] = data[l4 + 13];
+	}
+}
+
+static void
+classify_scalar(struct batch *b)
+{
+	int i;
+	uint64_t bit;
+
+	b->b_dns = b->b_dnstcp = b->b_syn = b->b_tcp = b->b_finrst = 0;
+	for (i = 0; i < b->b_count; ++i) {
+		if (!(b->b_mactype[i] == MAC_IP4 && b->b_ipver[i] == 4) &&
+		    !(b->b_mactype[i] == MAC_IP6 && b->b_ipver[i] == 6))
+			continue;
+		bit = 1ULL << i;
+		if (b->b_proto[i] == PR_UDP) {
+			if (b->b_sport[i] == 53 || b->b_dport[i] == 53)
+				b->b_dns |= bit;
+		} else if (b->b_proto[i] == PR_TCP) {
+			b->b_tcp |= bit;
+			if (b->b_sport[i] == 53 || b->b_dport[i] == 53)
+				b->b_dnstcp |= bit;
+			if (b->b_tcpfl[i] == TCPFL_SYN)
+				b->b_syn |= bit;
+			if (b->b_tcpfl[i] & (TCPFL_FIN | TCPFL_RST))
+				b->b_finrst |= bit;
+		}
+	}
+}
+
+#if defined(CLASSIFY_X86)
+
+/* Turn a vector of 8 16-bit all-ones/all-zeroes lanes into 8 mask bits. */
+__attribute__((target("sse2")))
+static inline uint64_t
+mask8(__m128i v)
+{
+	return ((uint64_t)(_mm_movemask_epi8(
+	    _mm_packs_epi16(v, _mm_setzero_si128())) & 0xff));
+}
+
+__attribute__((target("sse2")))
+static void
+classify_sse2(struct batch *b)
+{
+	int i;
+	uint64_t dns = 0, dnstcp = 0, syn = 0, tcp = 0, finrst = 0, valid;
+	const __m128i ip4 = _mm_set1_epi16(MAC_IP4);
+	const __m128i v4 = _mm_set1_epi16(4);
+	const __m128i ip6 = _mm_set1_epi16(MAC_IP6);
+	const __m128i v6 = _mm_set1_epi16(6);
+	const __m128i udp = _mm_set1_epi16(PR_UDP);
+	const __m128i tcpp = _mm_set1_epi16(PR_TCP);
+	const __m128i p53 = _mm_set1_epi16(53);
+	const __m128i fsyn = _mm_set1_epi16(TCPFL_SYN);
+	const __m128i ffr = _mm_set1_epi16(TCPFL_FIN | TCPFL_RST);
+	const __m128i zero = _mm_setzero_si128();
+
+	for (i = 0; i < b->b_count; i += 8) {
+		__m128i mt, ver, pr, sp, dp, fl, isip, isudp, istcp, x;
+
+		mt = _mm_loadu_si128((const __m128i *)&b->b_mactype[i]);
+		ver = _mm_loadu_si128((const __m128i *)&b->b_ipver[i]);
+		pr = _mm_loadu_si128((const __m128i *)&b->b_proto[i]);
+		sp = _mm_loadu_si128((const __m128i *)&b->b_sport[i]);
+		dp = _mm_loadu_si128((const __m128i *)&b->b_dport[i]);
+		fl = _mm_loadu_si128((const __m128i *)&b->b_tcpfl[i]);
+
+		isip = _mm_or_si128(
+		    _mm_and_si128(_mm_cmpeq_epi16(mt, ip4),
+		    _mm_cmpeq_epi16(ver, v4)),
+		    _mm_and_si128(_mm_cmpeq_epi16(mt, ip6),
+		    _mm_cmpeq_epi16(ver, v6)));
+		isudp = _mm_and_si128(isip, _mm_cmpeq_epi16(pr, udp));
+		istcp = _mm_and_si128(isip, _mm_cmpeq_epi16(pr, tcpp));
+
+		x = _mm_or_si128(_mm_cmpeq_epi16(sp, p53),
+		    _mm_cmpeq_epi16(dp, p53));
+		dns |= mask8(_mm_and_si128(isudp, x)) << i;
+		dnstcp |= mask8(_mm_and_si128(istcp, x)) << i;
+		tcp |= mask8(istcp) << i;
+		syn |= mask8(_mm_and_si128(istcp,
+		    _mm_cmpeq_epi16(fl, fsyn))) << i;
+		x = _mm_cmpeq_epi16(_mm_and_si128(fl, ffr), zero);
+		finrst |= mask8(_mm_andnot_si128(x, istcp)) << i;
+	}
+
+	valid = (b->b_count >= 64) ? ~0ULL : ((1ULL << b->b_count) - 1);
+	b->b_dns = dns & valid;
+	b->b_dnstcp = dnstcp & valid;
+	b->b_syn = syn & valid;
+	b->b_tcp = tcp & valid;
+	b->b_finrst = finrst & valid;
+}
+
+/* Turn a vector of 16 16-bit all-ones/all-zeroes lanes into 16 mask bits. */
+__attribute__((target("avx2")))
+static inline uint64_t
+mask16(__m256i v)
+{
+	uint32_t m = _mm256_movemask_epi8(
+	    _mm256_packs_epi16(v, _mm256_setzero_si256()));
+	/* packs works per 128-bit lane: bits 0-7 and 16-23 are ours. */
+	return ((uint64_t)((m & 0xff) | ((m >> 8) & 0xff00)));
+}
+
+__attribute__((target("avx2")))
+static void
+classify_avx2(struct batch *b)
+{
+	int i;
+	uint64_t dns = 0, dnstcp = 0, syn = 0, tcp = 0, finrst = 0, valid;
+	const __m256i ip4 = _mm256_set1_epi16(MAC_IP4);
+	const __m256i v4 = _mm256_set1_epi16(4);
+	const __m256i ip6 = _mm256_set1_epi16(MAC_IP6);
+	const __m256i v6 = _mm256_set1_epi16(6);
+	const __m256i udp = _mm256_set1_epi16(PR_UDP);
+	const __m256i tcpp = _mm256_set1_epi16(PR_TCP);
+	const __m256i p53 = _mm256_set1_epi16(53);
+	const __m256i fsyn = _mm256_set1_epi16(TCPFL_SYN);
+	const __m256i ffr = _mm256_set1_epi16(TCPFL_FIN | TCPFL_RST);
+	const __m256i zero = _mm256_setzero_si256();
+
+	for (i = 0; i < b->b_count; i += 16) {
+		__m256i mt, ver, pr, sp, dp, fl, isip, isudp, istcp, x;
+
+		mt = _mm256_loadu_si256((const __m256i *)&b->b_mactype[i]);
+		ver = _mm256_loadu_si256((const __m256i *)&b->b_ipver[i]);
+		pr = _mm256_loadu_si256((const __m256i *)&b->b_proto[i]);
+		sp = _mm256_loadu_si256((const __m256i *)&b->b_sport[i]);
+		dp = _mm256_loadu_si256((const __m256i *)&b->b_dport[i]);
+		fl = _mm256_loadu_si256((const __m256i *)&b->b_tcpfl[i]);
+
+		isip = _mm256_or_si256(
+		    _mm256_and_si256(_mm256_cmpeq_epi16(mt, ip4),
+		    _mm256_cmpeq_epi16(ver, v4)),
+		    _mm256_and_si256(_mm256_cmpeq_epi16(mt, ip6),
+		    _mm256_cmpeq_epi16(ver, v6)));
+		isudp = _mm256_and_si256(isip, _mm256_cmpeq_epi16(pr, udp));
+		istcp = _mm256_and_si256(isip, _mm256_cmpeq_epi16(pr, tcpp));
+
+		x = _mm256_or_si256(_mm256_cmpeq_epi16(sp, p53),
+		    _mm256_cmpeq_epi16(dp, p53));
+		dns |= mask16(_mm256_and_si256(isudp, x)) << i;
+		dnstcp |= mask16(_mm256_and_si256(istcp, x)) << i;
+		tcp |= mask16(istcp) << i;
+		syn |= mask16(_mm256_and_si256(istcp,
+		    _mm256_cmpeq_epi16(fl, fsyn))) << i;
+		x = _mm256_cmpeq_epi16(_mm256_and_si256(fl, ffr), zero);
+		finrst |= mask16(_mm256_andnot_si256(x, istcp)) << i;
+	}
+
+	valid = (b->b_count >= 64) ? ~0ULL : ((1ULL << b->b_count) - 1);
+	b->b_dns = dns & valid;
+	b->b_dnstcp = dnstcp & valid;
+	b->b_syn = syn & valid;
+	b->b_tcp = tcp & valid;
+	b->b_finrst = finrst & valid;
+}
+
+#endif	/* CLASSIFY_X86 */
+
+/*
+ * Pick the widest classifier this CPU supports.
+ */
+void
+classify_init(void)
+{
+#if defined(CLASSIFY_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		classify_fn = classify_avx2;
+		classify_impl = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		classify_fn = classify_sse2;
+		classify_impl = "sse2";
+	}
+#endif
+}
+
+/*
+ * Use the named classifier ("scalar", "sse2" or "avx2") instead, for
+ * benchmarking. Returns -1 if it isn't available on this CPU.
+ */
+int
+classify_select(const char *impl)
+{
+#if defined(CLASSIFY_X86)
+	__builtin_cpu_init();
+#endif
+	if (strcmp(impl, "scalar") == 0) {
+		classify_fn = classify_scalar;
+#if defined(CLASSIFY_X86)
+	} else if (strcmp(impl, "sse2") == 0 &&
+	    __builtin_cpu_supports("sse2")) {
+		classify_fn = classify_sse2;
+	} else if (strcmp(impl, "avx2") == 0 &&
+	    __builtin_cpu_supports("avx2")) {
+		classify_fn = classify_avx2;
+#endif
+	} else {
+		return (-1);
+	}
+	classify_impl = impl;
+	return (0);
+}
+
+void
+batch_classify(struct batch *b)
+{
+	classify_fn(b);
+}
@@ -0,0 +1,72 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+#if !defined(_CLASSIFY_H)
+#define _CLASSIFY_H
+
+#include <stdint.h>
+
+#include "input.h"
+
+/* Must be a multiple of 16 (one AVX2 vector of 16-bit lanes). */
+#define	BATCH_MAX	64
+
+/*
+ * A batch of capture records. The header fields we filter on are gathered
+ * into one array per field so that the whole batch can be classified with
+ * vector compares. Unused or unparseable slots have b_mactype == 0.
+ */
+struct batch {
+	int b_count;
+	struct pkthdr b_hdr[BATCH_MAX];
+	const uint8_t *b_data[BATCH_MAX];
+	uint16_t b_l3off[BATCH_MAX];	/* offset of IP header */
+	uint16_t b_l4off[BATCH_MAX];	/* offset of TCP/UDP header */
+	uint32_t b_iplen[BATCH_MAX];	/* IP datagram length, with header */
+	uint32_t b_src[BATCH_MAX];	/* IPv4 only, see batch_gather() */
+	uint32_t b_dst[BATCH_MAX];
+
+	uint16_t b_mactype[BATCH_MAX];
+	uint16_t b_ipver[BATCH_MAX];
+	uint16_t b_proto[BATCH_MAX];
+	uint16_t b_sport[BATCH_MAX];
+	uint16_t b_dport[BATCH_MAX];
+	uint16_t b_tcpfl[BATCH_MAX];
+
+	/* Classification results: bit i is set if record i matches. */
+	uint64_t b_dns;			/* UDP to or from port 53 */
+	uint64_t b_dnstcp;		/* TCP to or from port 53 */
+	uint64_t b_syn;			/* TCP with only SYN set */
+	uint64_t b_tcp;			/* any TCP (for -a) */
+	uint64_t b_finrst;		/* TCP with FIN or RST set */
+};
+
+/* Index of the lowest set bit in a non-zero mask. */
+static inline int
+ctz64(uint64_t v)
+{
+#if defined(__GNUC__)
+	return (__builtin_ctzll(v));
+#else
+	int i = 0;
+	while ((v & 1) == 0) {
+		v >>= 1;
+		++i;
+	}
+	return (i);
+#endif
+}
+
+extern const char *classify_impl;
+
+void classify_init(void);
+int classify_select(const char *impl);
+void batch_gather(struct batch *b);
+void batch_classify(struct batch *b);
+
+#endif
@@ -0,0 +1,306 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * Per-client accounting. One connbal may be watching hundreds of containers
+ * on a compute node, and each of them is a separate client: this is where we
+ * keep track of what each one has cost us and how its lookups went.
+ *
+ * The state a client causes us to keep is charged to it in bytes: its
+ * outstanding DNS requests, the backends, services and TTL records for the
+ * names it looks up, the SRV targets and CNAME aliases from its answers, the
+ * -a connections to its backends, and its DNS-over-TCP streams. With -m,
+ * part of each quota is kept for outstanding requests: everything else is
+ * refused once it would eat into that room, and a new request makes room
+ * by dropping the client's oldest ones. So a client whose backends and
+ * records have filled its quota still has its lookups tracked, and a busy
+ * client can't crowd out everyone else.
+ *
+ * Names interned for backends (see intern_name()) are shared between
+ * clients, so they aren't charged to any of them. Nor are DNS-over-TCP
+ * streams from clients we haven't otherwise seen, which only the global
+ * limits in dnstcp.c bound.
+ *
+ * Clients are never freed, so their pointers are stable; they're found by
+ * address through an open-addressed index that is at most half full.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "addr.h"
+#include "hash.h"
+#include "packet.h"
+#include "client.h"
+
+extern int balstats;
+extern int ttlstats;
+
+size_t clientquota = 0;
+
+/*
+ * Kept for requests: a quarter of the quota, but at least this much, which
+ * is room for one (-m is at least a kbyte, so this leaves half for the rest).
+ */
+#define	CLIENT_REQMIN	512
+
+static struct client **clients = NULL;
+static uint32_t nclients = 0;
+static uint32_t clientssize = 0;
+
+static struct client **cindex = NULL;
+static uint32_t cindexsize = 0;
+
+static void
+cindex_insert(struct client *c)
+{
+	uint32_t i, mask = cindexsize - 1;
+
+	i = chash64(c->c_addr) & mask;
+	while (cindex[i] != NULL)
+		i = (i + 1) & mask;
+	cindex[i] = c;
+}
+
+/*
+ * Returns the client with address "addr", adding it if "create" is set.
+ */
+struct client *
+client_find(uint32_t addr, int create)
+{
+	struct client *c;
+	uint32_t i, mask;
+
+	if (cindexsize > 0) {
+		mask = cindexsize - 1;
+		i = chash64(addr) & mask;
+		while (cindex[i] != NULL) {
+			if (cindex[i]->c_addr == addr)
+				return (cindex[i]);
+			i = (i + 1) & mask;
+		}
+	}
+	if (!create)
+		return (NULL);
+
+	c = calloc(sizeof (*c), 1);
+	c->c_addr = addr;
+	if (nclients == clientssize) {
+		clientssize = (clientssize == 0) ? 256 : clientssize * 2;
+		clients = realloc(clients, clientssize * sizeof (*clients));
+	}
+	clients[nclients++] = c;
+
+	if (nclients * 2 > cindexsize) {
+		free(cindex);
+		cindexsize = (cindexsize == 0) ? 1024 : cindexsize * 2;
+		cindex = calloc(cindexsize, sizeof (*cindex));
+		for (i = 0; i < nclients; ++i)
+			cindex_insert(clients[i]);
+	} else {
+		cindex_insert(c);
+	}
+	return (c);
+}
+
+/* Clients in the order they were first seen. */
+struct client *
+client_get(uint32_t i)
+{
+	return (clients[i]);
+}
+
+uint32_t
+client_count(void)
+{
+	return (nclients);
+}
+
+/*
+ * Charge "bytes" to a client. Returns -1 (and charges nothing) if that would
+ * put it over its quota.
+ */
+int
+client_reserve(struct client *c, size_t bytes)
+{
+	if (clientquota != 0 && c->c_mem + bytes > clientquota)
+		return (-1);
+	c->c_mem += bytes;
+	return (0);
+}
+
+/*
+ * Charge "bytes" of anything but a request to a client. Returns -1 (and
+ * counts a refusal) if it would leave less than the requests' room. Requests
+ * using more than that make way.
+ */
+int
+client_charge(struct client *c, size_t bytes)
+{
+	size_t room;
+
+	if (clientquota != 0) {
+		room = clientquota / 4;
+		if (room < CLIENT_REQMIN)
+			room = CLIENT_REQMIN;
+		if (c->c_mem - c->c_reqmem + bytes > clientquota - room) {
+			c->c_refused++;
+			return (-1);
+		}
+	}
+	while (client_reserve(c, bytes) != 0) {
+		if (evict_dnsreq(c) != 0) {
+			c->c_refused++;
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+void
+client_release(struct client *c, size_t bytes)
+{
+	c->c_mem -= bytes;
+}
+
+/*
+ * Charge a new request to a client, making room by dropping its oldest
+ * outstanding requests if need be. Returns -1 (and counts a refusal) if even
+ * that isn't enough.
+ */
+int
+client_charge_req(struct client *c, size_t bytes)
+{
+	while (client_reserve(c, bytes) != 0) {
+		if (evict_dnsreq(c) != 0) {
+			c->c_refused++;
+			return (-1);
+		}
+	}
+	c->c_reqmem += bytes;
+	return (0);
+}
+
+void
+client_release_req(struct client *c, size_t bytes)
+{
+	c->c_mem -= bytes;
+	c->c_reqmem -= bytes;
+}
+
+/*
+ * A tracked query sent at sec.usec was answered at asec.ausec.
+ */
+void
+client_answer(struct client *c, uint32_t sec, uint32_t usec, uint32_t asec,
+    uint32_t ausec)
+{
+	int64_t lat;
+
+	lat = ((int64_t)asec - sec) * 1000000 + ((int64_t)ausec - usec);
+	if (lat < 0)
+		lat = 0;
+	c->c_answers++;
+	c->c_latsum += lat;
+	if (lat > c->c_latmax)
+		c->c_latmax = lat;
+}
+
+/*
+ * Print a client's line of the client summary. Also used by the daemon's
+ * query thread, on copies in a snapshot.
+ */
+void
+print_client(FILE *out, const struct client *c)
+{
+	char srcs[ADDR_STRLEN];
+
+	fprintf(out, "%s\t%llu\t%llu\t", addr_fmt(c->c_addr, srcs),
+	    (unsigned long long)c->c_lookups,
+	    (unsigned long long)c->c_answers);
+	if (c->c_answers == 0)
+		fprintf(out, "-\t-\t");
+	else
+		fprintf(out, "%.2f\t%.2f\t",
+		    (double)c->c_latsum / c->c_answers / 1000.0,
+		    c->c_latmax / 1000.0);
+	fprintf(out, "%llu\t%llu\t%u\t%u\t%llu\t%llu\t%zu\n",
+	    (unsigned long long)c->c_conns, (unsigned long long)c->c_retries,
+	    c->c_nbackends, c->c_nsvcs, (unsigned long long)c->c_evicted,
+	    (unsigned long long)c->c_refused, (c->c_mem + 1023) / 1024);
+}
+
+static void
+print_client_header(FILE *out)
+{
+	fprintf(out, "# client\tlookups\tanswered\tavg dns ms\t"
+	    "max dns ms\t#conns\t#retry\t#backends\t#services\tevicted\t"
+	    "refused\tkbytes\n");
+}
+
+/*
+ * Print one line per client (or only for "addr", unless it's ADDR_NONE).
+ */
+void
+print_client_summary(FILE *out, uint32_t addr)
+{
+	uint32_t i;
+
+	tally_clients();
+	print_client_header(out);
+	for (i = 0; i < nclients; ++i) {
+		if (addr == ADDR_NONE || clients[i]->c_addr == addr)
+			print_client(out, clients[i]);
+	}
+}
+
+/*
+ * Write a separate report for each client into a file named after it in
+ * "dir": its backends, its -b and -t lines if those are on, and its line of
+ * the client summary. Each client's records are found from its own lists, so
+ * this is linear in the number of records, not clients times records.
+ */
+int
+write_client_reports(const char *dir)
+{
+	char path[1024], srcs[ADDR_STRLEN];
+	struct client *c;
+	FILE *f;
+	uint32_t i;
+	int n, ret = 0;
+
+	tally_clients();
+	for (i = 0; i < nclients; ++i) {
+		c = clients[i];
+		n = snprintf(path, sizeof (path), "%s/%s", dir,
+		    addr_fmt(c->c_addr, srcs));
+		if (n < 0 || (size_t)n >= sizeof (path)) {
+			fprintf(stderr, "report path too long: %s\n", dir);
+			return (-1);
+		}
+		if ((f = fopen(path, "w")) == NULL) {
+			perror(path);
+			ret = -1;
+			continue;
+		}
+		print_summary(f, c->c_addr);
+		if (balstats)
+			print_balance_summary(f, c->c_addr);
+		if (ttlstats)
+			print_ttl_summary(f, c->c_addr);
+		print_client_header(f);
+		print_client(f, c);
+		if (fclose(f) != 0) {
+			perror(path);
+			ret = -1;
+		}
+	}
+	return (ret);
+}
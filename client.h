@@ -0,0 +1,64 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+#if !defined(_CLIENT_H)
+#define _CLIENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct dnsreq;
+struct service;
+struct ttlrec;
+
+/*
+ * Everything we know about one client (a source of DNS lookups), and what
+ * it has cost us. See client.c.
+ */
+struct client {
+	uint32_t c_addr;
+	size_t c_mem;			/* bytes charged to this client */
+	size_t c_reqmem;		/* ... for outstanding requests */
+	struct dnsreq *c_oldest;	/* its outstanding DNS requests, */
+	struct dnsreq *c_newest;	/*   oldest first */
+	uint32_t c_nreqs;
+	uint32_t c_nbackends;
+	uint32_t c_nsvcs;
+	uint32_t c_firstb;		/* its backends' ids + 1 (0 if none), */
+	uint32_t c_lastb;		/*   linked in the order first seen */
+	struct service *c_svcs;		/* its services, newest first */
+	struct ttlrec *c_ttlrecs;	/* its TTL records, newest first */
+	uint64_t c_lookups;		/* tracked queries sent */
+	uint64_t c_answers;		/* ... and answered */
+	uint64_t c_latsum;		/* sum of answer latency, usec */
+	uint32_t c_latmax;
+	uint64_t c_evicted;		/* requests dropped to make room */
+	uint64_t c_refused;		/* state not kept, over quota */
+	uint64_t c_conns;		/* filled in by tally_clients() */
+	uint64_t c_retries;
+};
+
+/* Per-client memory quota in bytes (-m), or 0 for no limit. */
+extern size_t clientquota;
+
+struct client *client_find(uint32_t addr, int create);
+struct client *client_get(uint32_t i);
+uint32_t client_count(void);
+int client_reserve(struct client *c, size_t bytes);
+int client_charge(struct client *c, size_t bytes);
+void client_release(struct client *c, size_t bytes);
+int client_charge_req(struct client *c, size_t bytes);
+void client_release_req(struct client *c, size_t bytes);
+void client_answer(struct client *c, uint32_t sec, uint32_t usec,
+    uint32_t asec, uint32_t ausec);
+void print_client(FILE *out, const struct client *c);
+void print_client_summary(FILE *out, uint32_t addr);
+int write_client_reports(const char *dir);
+
+#endif
@@ -12,29 +12,25 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/time.h>
 
 #include "enums.h"
+#include "input.h"
+#include "classify.h"
+#include "addr.h"
+#include "readahead.h"
 #include "packet.h"
+#include "daemon.h"
+#include "loss.h"
+#include "client.h"
 
 const char *namefilt = NULL;
+int ttlstats = 0;
+int balstats = 0;
+int daemonmode = 0;
+int lossreport = 0;
 int gotint = 0;
-
-/* Snoop data structures from RFC1761. Ints are big-endian. */
-
-struct snoophdr {
-	char magic[8];
-	uint32_t version;
-	uint32_t dltype;
-};
-
-struct pkthdr {
-	uint32_t len;
-	uint32_t snap;
-	uint32_t reclen;
-	uint32_t drops;
-	uint32_t sec;
-	uint32_t usec;
-};
+int gottick = 0;
 
 void
 sigint_handler(int sig)
@@ -42,30 +38,150 @@ sigint_handler(int sig)
 	gotint = 1;
 }
 
+void
+sigalrm_handler(int sig)
+{
+	gottick = 1;
+}
+
 void
 usage(void)
 {
 	fprintf(stderr,
-	    "Usage: ./connbal [-a] [-f inputfile] [-F filter]\n\n"
+	    "Usage: ./connbal [-abclrt] [-f inputfile] [-F filter] "
+	    "[-j threads]\n"
+	    "                 [-D socketpath] [-C reportdir] [-m kbytes]\n\n"
 	    "  -a               examine all TCP packets, not just SYNs\n"
+	    "  -b               also report balance metrics per service,\n"
+	    "                   worst balanced first\n"
+	    "  -c               also report lookups, DNS latency and\n"
+	    "                   memory use per client\n"
+	    "  -C reportdir     at the end, also write a separate report\n"
+	    "                   for each client into reportdir\n"
+	    "  -D socketpath    answer queries about the data so far on\n"
+	    "                   a Unix socket while reading, and keep\n"
+	    "                   answering at end of input until killed\n"
 	    "  -f inputfile     snoop-format input file to read\n"
-	    "                   instead of stdin\n"
+	    "                   instead of stdin (may be gzip or zstd\n"
+	    "                   compressed)\n"
 	    "  -F filter        substring to look for in DNS names\n"
-	    "                   names that don't match will be ignored\n");
+	    "                   names that don't match will be ignored\n"
+	    "  -j threads       decompress a compressed inputfile\n"
+	    "                   using this many threads\n"
+	    "  -l               report capture loss (drops, truncated\n"
+	    "                   records, lag) every minute on stderr,\n"
+	    "                   and in the summary\n"
+	    "  -m kbytes        limit the memory used to track each\n"
+	    "                   client\n"
+	    "  -r               read input ahead in a separate thread\n"
+	    "                   (not with -j, whose threads read ahead\n"
+	    "                   themselves)\n"
+	    "  -t               also report how well clients respect\n"
+	    "                   DNS TTLs\n");
+}
+
+/*
+ * Frame up to BATCH_MAX records out of the input buffer into a batch, reading
+ * more input only if the buffer doesn't hold even one whole record.
+ *
+ * Returns 0 on success (b_count == 0 means end of input), -1 on error.
+ */
+static int
+read_batch(struct input *in, struct batch *b)
+{
+	int r;
+
+	b->b_count = 0;
+	while (b->b_count < BATCH_MAX) {
+		r = input_frame(in, &b->b_hdr[b->b_count],
+		    &b->b_data[b->b_count]);
+		if (r == 1) {
+			b->b_count++;
+			continue;
+		}
+		if (r == -1) {
+			fprintf(stderr, "bad capture record length\n");
+			return (-1);
+		}
+		if (b->b_count > 0)
+			break;
+		r = input_fill(in);
+		if (r == -1) {
+			/* An empty batch with gottick set means we're idle. */
+			if (gotint || gottick)
+				return (0);
+			fprintf(stderr, "failed to read capture record\n");
+			return (-1);
+		}
+		if (r == 1) {
+			if (in->in_len - in->in_off >= sizeof (struct pkthdr)) {
+				fprintf(stderr,
+				    "failed to read capture data\n");
+				return (-1);
+			}
+			break;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Find the payload of a TCP segment to or from port 53 and pass it on for
+ * DNS-over-TCP reassembly.
+ */
+static void
+dispatch_dns_tcp(const struct batch *b, int i, uint32_t src, uint32_t dst)
+{
+	const struct pkthdr *hdr = &b->b_hdr[i];
+	const uint8_t *data = b->b_data[i];
+	int off = b->b_l4off[i];
+	int thlen, plen, trunc = 0;
+	uint32_t seq;
+
+	memcpy(&seq, data + off + 4, 4);
+	seq = ntohl(seq);
+	thlen = (data[off + 12] >> 4) * 4;
+
+	/* The IP length tells us how much payload there really was. */
+	plen = b->b_l3off[i] + (int)b->b_iplen[i] - (off + thlen);
+	if (plen < 0)
+		return;
+	if ((uint32_t)(off + thlen + plen) > hdr->snap) {
+		trunc = 1;
+		plen = (int)hdr->snap - (off + thlen);
+		if (plen < 0)
+			plen = 0;
+	}
+
+	got_dns_tcp(src, dst, b->b_sport[i], b->b_dport[i],
+	    seq, b->b_tcpfl[i], data + off + thlen, plen, trunc, hdr->sec,
+	    hdr->usec);
 }
 
 int
 main(int argc, char *argv[])
 {
 	struct snoophdr filehdr;
-	uint8_t *data;
-	int dlen;
+	struct input in;
+	static struct batch b;
 	uint32_t lastclean = 0;
+	uint32_t lastsnap = 0, now = 0, idle = 0;
+	struct sigaction sa;
+	struct itimerval tick;
+	sigset_t set, oset;
+	uint64_t records = 0;
+	const char *sockpath = NULL;
+	const char *reportdir = NULL;
 	FILE *inp = stdin;
-	int c;
+	int c, i;
 	int alltcp = 0;
+	int readahead = 0;
+	int clientstats = 0;
+	int nthreads = 1;
+	long quota;
+	uint64_t todo, bit, dnsbits;
 
-	while ((c = getopt(argc, argv, "af:F:")) != -1) {
+	while ((c = getopt(argc, argv, "abcC:D:f:F:j:lm:rt")) != -1) {
 		switch (c) {
 		case 'f':
 			inp = fopen(optarg, "r");
@@ -80,8 +196,46 @@ main(int argc, char *argv[])
 		case 'a':
 			alltcp = 1;
 			break;
+		case 'l':
+			lossreport = 1;
+			break;
+		case 'r':
+			readahead = 1;
+			break;
+		case 'b':
+			balstats = 1;
+			break;
+		case 'c':
+			clientstats = 1;
+			break;
+		case 'C':
+			reportdir = optarg;
+			break;
+		case 'm':
+			quota = atol(optarg);
+			if (quota < 1) {
+				usage();
+				return (1);
+			}
+			clientquota = (size_t)quota * 1024;
+			break;
+		case 'D':
+			sockpath = optarg;
+			daemonmode = 1;
+			break;
+		case 't':
+			ttlstats = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1) {
+				usage();
+				return (1);
+			}
+			break;
 		case '?':
-			if (optopt == 'f' || optopt == 'F') {
+			if (optopt == 'f' || optopt == 'F' || optopt == 'j' ||
+			    optopt == 'D' || optopt == 'C' || optopt == 'm') {
 				fprintf(stderr,
 				    "Option -%c requires an argument\n",
 				    optopt);
@@ -98,8 +252,23 @@ main(int argc, char *argv[])
 	}
 
 	signal(SIGINT, sigint_handler);
+	if (daemonmode) {
+		signal(SIGTERM, sigint_handler);
+		if (daemon_start(sockpath) != 0)
+			return (1);
+	}
+	classify_init();
+	input_init(&in, inp);
+	if (readahead && nthreads > 1) {
+		fprintf(stderr, "warning: -r is ignored with -j, which "
+		    "reads ahead already\n");
+	} else if (readahead) {
+		input_readahead(&in);
+	}
+	if (input_decompress(&in, nthreads) != 0)
+		return (2);
 
-	if (fread(&filehdr, sizeof (filehdr), 1, inp) != 1) {
+	if (input_read_hdr(&in, &filehdr) != 0) {
 		fprintf(stderr, "failed to read snoop header\n");
 		return (2);
 	}
@@ -116,140 +285,215 @@ main(int argc, char *argv[])
 		return (2);
 	}
 
-	dlen = 512;
-	data = malloc(dlen);
+	/*
+	 * In daemon mode a timer ticks once a second of real time, both to
+	 * pace the snapshots and to interrupt a read that's waiting on a
+	 * live capture that has gone quiet. Hence sigaction(): the read
+	 * mustn't be restarted.
+	 */
+	if (daemonmode) {
+		memset(&sa, 0, sizeof (sa));
+		sa.sa_handler = sigalrm_handler;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGALRM, &sa, NULL);
+		memset(&tick, 0, sizeof (tick));
+		tick.it_interval.tv_sec = SNAP_INTERVAL;
+		tick.it_value.tv_sec = SNAP_INTERVAL;
+		setitimer(ITIMER_REAL, &tick, NULL);
+	}
 
 	while (1) {
-		struct pkthdr hdr;
-		int iplen, plen, off;
-		uint32_t src, dst;
-		uint16_t sport, dport;
-		uint16_t mactype;
-		uint8_t proto;
-
-		if (fread(&hdr, sizeof (hdr), 1, inp) != 1) {
-			if (gotint) {
-				fprintf(stderr, "\n");
-				break;
-			}
-			if (feof(inp))
-				break;
-			fprintf(stderr, "failed to read capture record\n");
+		if (read_batch(&in, &b) != 0)
 			return (2);
+		if (b.b_count == 0 && gottick && !gotint) {
+			/*
+			 * Nothing has come in for a tick. Capture time
+			 * stands still while the capture is quiet, but
+			 * the windows shouldn't, so move the snapshot's on
+			 * by the real time that has passed.
+			 */
+			gottick = 0;
+			idle += SNAP_INTERVAL;
+			snapshot_backends(now + idle, records);
+			lastsnap = now;
+			continue;
 		}
-
-		hdr.reclen = ntohl(hdr.reclen);
-		plen = hdr.reclen - sizeof (hdr);
-
-		/* Expand "data" until it can fit this entire packet. */
-		while (plen > dlen) {
-			dlen *= 2;
-			free(data);
-			data = malloc(dlen);
-		}
-
-		if (fread(data, hdr.reclen - sizeof (hdr), 1, inp) != 1) {
-			if (gotint) {
+		if (b.b_count == 0) {
+			if (gotint)
 				fprintf(stderr, "\n");
-				break;
-			}
-			fprintf(stderr, "failed to read capture data\n");
-			return (2);
+			break;
 		}
 
-		hdr.len = ntohl(hdr.len);
-		hdr.snap = ntohl(hdr.snap);
-		hdr.drops = ntohl(hdr.drops);
-		hdr.sec = ntohl(hdr.sec);
-		hdr.usec = ntohl(hdr.usec);
-
 		/*
-		 * Time out DNS requests after 10 sec -- stop tracking them so
-		 * that they don't take up space in our hash table.
+		 * Gather the header fields of the whole batch and classify
+		 * them in one go, then hand off just the interesting records.
+		 * We walk the result bits in ascending order so that records
+		 * are still processed in capture order.
 		 */
-		if (hdr.sec - lastclean > 10) {
-			clean_dns(hdr.sec);
-			lastclean = hdr.sec;
-		}
-
-		off = 0;
-		off += 6; /* src mac */
-		off += 6; /* dest mac */
-
-		memcpy(&mactype, data + off, 2);
-		off += 2;
-		mactype = ntohs(mactype);
+		batch_gather(&b);
+		batch_classify(&b);
+		records += b.b_count;
+		now = b.b_hdr[b.b_count - 1].sec;
+		idle = 0;
+		loss_batch(b.b_hdr, b.b_count);
+
+		dnsbits = b.b_dns | b.b_dnstcp;
+		todo = dnsbits | (alltcp ? b.b_tcp : b.b_syn);
+		while (todo != 0) {
+			const struct pkthdr *hdr;
+			const uint8_t *data;
+			uint32_t src, dst;
+			uint16_t sport, dport;
+			uint32_t seq;
+			int off;
+
+			i = ctz64(todo);
+			bit = 1ULL << i;
+			todo &= ~bit;
+
+			hdr = &b.b_hdr[i];
+			data = b.b_data[i];
+			src = b.b_src[i];
+			dst = b.b_dst[i];
+			sport = b.b_sport[i];
+			dport = b.b_dport[i];
+			off = b.b_l4off[i];
 
-		if (mactype == MAC_DOT1Q) {
-			off += 2; /* ignore vlan id for now */
-			memcpy(&mactype, data + off, 2);
-			off += 2;
-			mactype = ntohs(mactype);
-		}
+			/*
+			 * Only DNS we track creates keys for new IPv6
+			 * addresses, so DNS gets tentative keys for
+			 * parse_dns() to resolve. A SYN to or from an address
+			 * we haven't seen in DNS can't be to a backend.
+			 */
+			if (b.b_ipver[i] == 6) {
+				const uint8_t *ip6 = data + b.b_l3off[i];
+				if (dnsbits & bit) {
+					src = addr_tentative(ip6 + 8, 0);
+					dst = addr_tentative(ip6 + 24, 1);
+				} else {
+					src = addr_from6(ip6 + 8, 0);
+					dst = addr_from6(ip6 + 24, 0);
+				}
+				if (src == ADDR_NONE || dst == ADDR_NONE)
+					continue;
+			}
 
-		if (mactype != MAC_IP4)
-			continue;
+			/*
+			 * Time out DNS requests after 10 sec -- stop tracking
+			 * them so that they don't take up space in our hash
+			 * table.
+			 */
+			if (hdr->sec - lastclean > 10) {
+				clean_dns(hdr->sec);
+				clean_dns_tcp(hdr->sec);
+				clean_aliases(hdr->sec);
+				lastclean = hdr->sec;
+			}
 
-		/* We only handle IPv4. */
-		if ((data[off] & 0xf0) >> 4 != 4)
-			continue;
-		iplen = (data[off] & 0x0f) * 4;
-
-		memcpy(&src, data + off + 12, 4);
-		src = ntohl(src);
-		memcpy(&dst, data + off + 16, 4);
-		dst = ntohl(dst);
-
-		proto = data[off + 9];
-
-		off += iplen;
-		
-		if (proto == PR_UDP) {
-			memcpy(&sport, data + off, 2);
-			sport = ntohs(sport);
-			memcpy(&dport, data + off + 2, 2);
-			dport = ntohs(dport);
-			off += 4;
-			off += 4; /* length + checksum */
-
-			if (sport == 53 || dport == 53) {
+			if (b.b_dns & bit) {
+				off += 8; /* ports, length + checksum */
 				parse_dns(src, dst, sport, dport,
-				    data + off, hdr.snap - off, hdr.sec);
+				    data + off, hdr->snap - off, hdr->sec,
+				    hdr->usec);
+				continue;
 			}
 
-		} else if (proto == PR_TCP) {
-			memcpy(&sport, data + off, 2);
-			sport = ntohs(sport);
-			memcpy(&dport, data + off + 2, 2);
-			dport = ntohs(dport);
-
-			if (alltcp) {
-				if ((data[off + 13] & TCPFL_FIN) ||
-				    (data[off + 13] & TCPFL_RST)) {
-					got_tcp_fin(src, dst, sport, dport);
+			if (b.b_dnstcp & bit) {
+				dispatch_dns_tcp(&b, i, src, dst);
+				src = addr_resolve(src, 0);
+				dst = addr_resolve(dst, 0);
+				if (src == ADDR_NONE || dst == ADDR_NONE)
 					continue;
-				}
-				got_tcp(src, dst, sport, dport);
-				continue;
 			}
 
 			/*
-			 * When the only flag set is TCPFL_SYN, it's a request
-			 * for a new connection.
+			 * A SYN with the same ports and ISN as one we saw
+			 * recently is the client retrying, not a new
+			 * connection.
 			 */
-			if (data[off + 13] == TCPFL_SYN) {
-				got_tcp_syn(src, dst, sport, dport);
+			if (b.b_syn & bit) {
+				memcpy(&seq, data + off + 4, 4);
+				if (syn_retransmit(src, dst, sport, dport,
+				    ntohl(seq), hdr->sec)) {
+					got_tcp_retry(src, dst, dport);
+					continue;
+				}
+			}
+
+			if (alltcp) {
+				if (b.b_finrst & bit)
+					got_tcp_fin(src, dst, sport, dport);
+				else
+					got_tcp(src, dst, sport, dport,
+					    hdr->sec);
+
+			} else if (b.b_syn & bit) {
+				/*
+				 * The classifier only sets b_syn when the
+				 * only flag set is TCPFL_SYN, i.e. it's a
+				 * request for a new connection.
+				 */
+				got_tcp_syn(src, dst, sport, dport, hdr->sec);
 			}
 		}
 
+		loss_check(now);
+		/*
+		 * Reading a file, capture time runs far faster than real
+		 * time, and nobody can query snapshots that quickly: each
+		 * one is a full copy, so take them by the tick too.
+		 */
+		if (daemonmode && gottick && now - lastsnap >= SNAP_INTERVAL) {
+			gottick = 0;
+			snapshot_backends(now, records);
+			lastsnap = now;
+		}
+
 		if (gotint) {
 			fprintf(stderr, "\n");
 			break;
 		}
 	}
 
+	/*
+	 * In daemon mode, carry on answering queries about the complete
+	 * capture until we're told to stop.
+	 */
+	if (daemonmode) {
+		memset(&tick, 0, sizeof (tick));
+		setitimer(ITIMER_REAL, &tick, NULL);
+		snapshot_backends(now, records);
+		/* Block the signals first, so one can't slip in unseen. */
+		sigemptyset(&set);
+		sigaddset(&set, SIGINT);
+		sigaddset(&set, SIGTERM);
+		sigprocmask(SIG_BLOCK, &set, &oset);
+		while (!gotint)
+			sigsuspend(&oset);
+		sigprocmask(SIG_SETMASK, &oset, NULL);
+	}
+
 	/* And finally, print out the summary of all the data we collected. */
-	print_summary();
+	print_summary(stdout, ADDR_NONE);
+	if (balstats)
+		print_balance_summary(stdout, ADDR_NONE);
+	if (ttlstats)
+		print_ttl_summary(stdout, ADDR_NONE);
+	if (clientstats)
+		print_client_summary(stdout, ADDR_NONE);
+	if (lossreport)
+		print_loss_summary();
+	if (reportdir != NULL && write_client_reports(reportdir) != 0)
+		return (3);
+
+	if (in.in_ra != NULL) {
+		uint64_t fullstalls, emptystalls;
+		readahead_stats(in.in_ra, &fullstalls, &emptystalls);
+		fprintf(stderr, "read-ahead: %llu buffer-full stalls "
+		    "(parser behind), %llu buffer-empty stalls (input "
+		    "behind)\n", (unsigned long long)fullstalls,
+		    (unsigned long long)emptystalls);
+	}
 
 	return (0);
 }
@@ -0,0 +1,436 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * Daemon mode (-D): serve summaries over a Unix-domain socket while we keep
+ * reading the capture.
+ *
+ * The parser thread periodically copies the aggregates into a snapshot and
+ * publishes it; a separate thread accepts connections and answers queries
+ * from whichever snapshot is current. The only thing the two threads share
+ * is the pointer to the current snapshot (and its reference count), so a
+ * slow query never holds up packet processing.
+ *
+ * The protocol is line-based. Each command gets back zero or more lines of
+ * tab-separated output, followed by a line containing only ".":
+ *
+ *	summary [1m|10m|1h]	per-backend connections and DNS returns
+ *	services [1m|10m|1h]	per-service balance, worst first
+ *	clients			per-client lookups, latency and costs
+ *	stats			snapshot time, records read, backends
+ *	quit
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "addr.h"
+#include "packet.h"
+#include "daemon.h"
+
+static pthread_mutex_t snaplock = PTHREAD_MUTEX_INITIALIZER;
+static struct snapshot *cursnap = NULL;
+static int listenfd = -1;
+static char sockpath[sizeof (((struct sockaddr_un *)0)->sun_path)];
+
+struct snapshot *
+snap_new(uint32_t time, uint64_t packets)
+{
+	struct snapshot *sn;
+
+	sn = calloc(sizeof (*sn), 1);
+	sn->sn_time = time;
+	sn->sn_packets = packets;
+	sn->sn_rowsize = 256;
+	sn->sn_rows = malloc(sn->sn_rowsize * sizeof (struct snaprow));
+	sn->sn_namessize = 4096;
+	sn->sn_names = malloc(sn->sn_namessize);
+	return (sn);
+}
+
+/* Add a row to a snapshot being built, and return it for filling in. */
+struct snaprow *
+snap_add(struct snapshot *sn, const char *name)
+{
+	struct snaprow *r;
+	size_t len = strlen(name) + 1;
+
+	if (sn->sn_nrows == sn->sn_rowsize) {
+		sn->sn_rowsize *= 2;
+		sn->sn_rows = realloc(sn->sn_rows,
+		    sn->sn_rowsize * sizeof (struct snaprow));
+	}
+	while (sn->sn_nameslen + len > sn->sn_namessize) {
+		sn->sn_namessize *= 2;
+		sn->sn_names = realloc(sn->sn_names, sn->sn_namessize);
+	}
+	r = &sn->sn_rows[sn->sn_nrows++];
+	memset(r, 0, sizeof (*r));
+	r->sr_name = sn->sn_nameslen;
+	memcpy(sn->sn_names + sn->sn_nameslen, name, len);
+	sn->sn_nameslen += len;
+	return (r);
+}
+
+/* Copy the per-client totals into a snapshot being built. */
+void
+snap_add_clients(struct snapshot *sn)
+{
+	struct client *c;
+	int i;
+
+	tally_clients();
+	sn->sn_nclients = client_count();
+	sn->sn_clients = calloc(sn->sn_nclients + 1, sizeof (struct client));
+	for (i = 0; i < sn->sn_nclients; ++i) {
+		c = &sn->sn_clients[i];
+		memcpy(c, client_get(i), sizeof (*c));
+		c->c_oldest = c->c_newest = NULL;
+	}
+}
+
+static void
+snap_free(struct snapshot *sn)
+{
+	free(sn->sn_clients);
+	free(sn->sn_rows);
+	free(sn->sn_names);
+	free(sn);
+}
+
+static void
+snap_release(struct snapshot *sn)
+{
+	int refs;
+
+	pthread_mutex_lock(&snaplock);
+	refs = --sn->sn_refs;
+	pthread_mutex_unlock(&snaplock);
+	if (refs == 0)
+		snap_free(sn);
+}
+
+/* Make "sn" the snapshot that queries see from now on. */
+void
+snap_publish(struct snapshot *sn)
+{
+	struct snapshot *old;
+
+	sn->sn_refs = 1;
+	pthread_mutex_lock(&snaplock);
+	old = cursnap;
+	cursnap = sn;
+	pthread_mutex_unlock(&snaplock);
+	if (old != NULL)
+		snap_release(old);
+}
+
+static struct snapshot *
+snap_acquire(void)
+{
+	struct snapshot *sn;
+
+	pthread_mutex_lock(&snaplock);
+	sn = cursnap;
+	if (sn != NULL)
+		sn->sn_refs++;
+	pthread_mutex_unlock(&snaplock);
+	return (sn);
+}
+
+static void
+print_addr(FILE *out, uint32_t addr)
+{
+	char buf[ADDR_STRLEN];
+	fprintf(out, "%s", addr_fmt(addr, buf));
+}
+
+static void
+cmd_summary(FILE *out, struct snapshot *sn, int w)
+{
+	struct snaprow *r;
+	int i;
+
+	for (i = 0; i < sn->sn_nrows; ++i) {
+		r = &sn->sn_rows[i];
+		print_addr(out, r->sr_src);
+		fprintf(out, "\t");
+		print_addr(out, r->sr_dst);
+		fprintf(out, "\t%llu\t%llu\t%s\n",
+		    (unsigned long long)((w < 0) ? r->sr_conns :
+		    r->sr_wconns[w]),
+		    (unsigned long long)((w < 0) ? r->sr_dns : r->sr_wdns[w]),
+		    sn->sn_names + r->sr_name);
+	}
+}
+
+struct svcagg {
+	const struct snaprow *sa_first;
+	uint32_t sa_n;
+	uint32_t sa_used;
+	uint64_t sa_conns;
+	uint64_t sa_max;
+	double sa_sumsq;
+	double sa_cv;
+};
+
+static const struct snapshot *sortsnap;
+
+static int
+row_cmp(const void *a, const void *b)
+{
+	const struct snaprow *ra = *(const struct snaprow * const *)a;
+	const struct snaprow *rb = *(const struct snaprow * const *)b;
+
+	if (ra->sr_src != rb->sr_src)
+		return (ra->sr_src < rb->sr_src ? -1 : 1);
+	return (strcmp(sortsnap->sn_names + ra->sr_name,
+	    sortsnap->sn_names + rb->sr_name));
+}
+
+static int
+agg_cmp(const void *a, const void *b)
+{
+	const struct svcagg *sa = a, *sb = b;
+
+	if (sa->sa_cv < sb->sa_cv)
+		return (1);
+	if (sa->sa_cv > sb->sa_cv)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Per-service balance over a window: the same idea as -b, but computed here
+ * from the snapshot rows since the windowed counts aren't kept per service.
+ */
+static void
+cmd_services(FILE *out, struct snapshot *sn, int w)
+{
+	const struct snaprow **rows;
+	struct svcagg *aggs, *a = NULL;
+	uint64_t c;
+	double mean, var;
+	int i, n = 0;
+
+	rows = calloc(sn->sn_nrows + 1, sizeof (*rows));
+	aggs = calloc(sn->sn_nrows + 1, sizeof (*aggs));
+	for (i = 0; i < sn->sn_nrows; ++i)
+		rows[i] = &sn->sn_rows[i];
+	/* Only this thread sorts, so a static for the comparator is fine. */
+	sortsnap = sn;
+	qsort(rows, sn->sn_nrows, sizeof (*rows), row_cmp);
+
+	for (i = 0; i < sn->sn_nrows; ++i) {
+		/* As with -b, other-family backends can't be balanced over. */
+		if (addr_is_v6(rows[i]->sr_src) != addr_is_v6(rows[i]->sr_dst))
+			continue;
+		if (a == NULL || row_cmp(&a->sa_first, &rows[i]) != 0) {
+			a = &aggs[n++];
+			a->sa_first = rows[i];
+		}
+		c = (w < 0) ? rows[i]->sr_conns : rows[i]->sr_wconns[w];
+		a->sa_n++;
+		if (c > 0)
+			a->sa_used++;
+		a->sa_conns += c;
+		a->sa_sumsq += (double)c * c;
+		if (c > a->sa_max)
+			a->sa_max = c;
+	}
+	for (i = 0; i < n; ++i) {
+		a = &aggs[i];
+		if (a->sa_n < 2 || a->sa_conns == 0)
+			continue;
+		mean = (double)a->sa_conns / a->sa_n;
+		var = a->sa_sumsq / a->sa_n - mean * mean;
+		a->sa_cv = (var > 0.0) ? sqrt(var) / mean : 0.0;
+	}
+	qsort(aggs, n, sizeof (*aggs), agg_cmp);
+
+	for (i = 0; i < n; ++i) {
+		a = &aggs[i];
+		print_addr(out, a->sa_first->sr_src);
+		fprintf(out, "\t%u\t%llu\t", a->sa_n,
+		    (unsigned long long)a->sa_conns);
+		if (a->sa_conns == 0) {
+			fprintf(out, "-\t100.0\t-\t%s\n",
+			    sn->sn_names + a->sa_first->sr_name);
+			continue;
+		}
+		fprintf(out, "%.1f\t%.1f\t%.3f\t%s\n",
+		    100.0 * a->sa_max / a->sa_conns,
+		    100.0 * (a->sa_n - a->sa_used) / a->sa_n, a->sa_cv,
+		    sn->sn_names + a->sa_first->sr_name);
+	}
+	free(aggs);
+	free(rows);
+}
+
+static int
+handle_command(FILE *out, char *line)
+{
+	struct snapshot *sn;
+	char *cmd, *arg, *last;
+	int i, w = -1;
+
+	cmd = strtok_r(line, " \t\r\n", &last);
+	if (cmd == NULL)
+		return (0);
+	arg = strtok_r(NULL, " \t\r\n", &last);
+
+	if (strcmp(cmd, "quit") == 0)
+		return (-1);
+	if (strcmp(cmd, "summary") != 0 && strcmp(cmd, "services") != 0 &&
+	    strcmp(cmd, "clients") != 0 && strcmp(cmd, "stats") != 0) {
+		fprintf(out, "error: unknown command '%s'\n.\n", cmd);
+		return (0);
+	}
+	if (arg != NULL && strcmp(cmd, "clients") == 0) {
+		fprintf(out, "error: clients has no windows\n.\n");
+		return (0);
+	}
+	if (arg != NULL && (w = win_parse(arg)) == -1) {
+		fprintf(out, "error: unknown window '%s'\n.\n", arg);
+		return (0);
+	}
+
+	if ((sn = snap_acquire()) == NULL) {
+		fprintf(out, "error: no data yet\n.\n");
+		return (0);
+	}
+	if (strcmp(cmd, "summary") == 0) {
+		cmd_summary(out, sn, w);
+	} else if (strcmp(cmd, "services") == 0) {
+		cmd_services(out, sn, w);
+	} else if (strcmp(cmd, "clients") == 0) {
+		for (i = 0; i < sn->sn_nclients; ++i)
+			print_client(out, &sn->sn_clients[i]);
+	} else {
+		fprintf(out, "time\t%u\nrecords\t%llu\nbackends\t%d\n",
+		    sn->sn_time, (unsigned long long)sn->sn_packets,
+		    sn->sn_nrows);
+	}
+	snap_release(sn);
+	fprintf(out, ".\n");
+	return (0);
+}
+
+static void *
+daemon_thread(void *arg)
+{
+	struct timeval tv = { 30, 0 };
+	char line[256];
+	FILE *in, *out;
+	int fd;
+
+	(void) arg;
+	for (;;) {
+		fd = accept(listenfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				perror("accept");
+			continue;
+		}
+		/* Don't let an idle client hold the socket forever. */
+		(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof (tv));
+		in = fdopen(fd, "r");
+		out = fdopen(dup(fd), "w");
+		if (in == NULL || out == NULL) {
+			perror("fdopen");
+			if (in != NULL)
+				fclose(in);
+			else
+				close(fd);
+			if (out != NULL)
+				fclose(out);
+			continue;
+		}
+		while (fgets(line, sizeof (line), in) != NULL) {
+			if (handle_command(out, line) != 0)
+				break;
+			if (fflush(out) != 0)
+				break;
+		}
+		fclose(in);
+		fclose(out);
+	}
+	return (NULL);
+}
+
+/* Take the socket away when we exit, however we get there. */
+static void
+daemon_unlink(void)
+{
+	(void) unlink(sockpath);
+}
+
+/*
+ * Start listening for queries on a Unix socket at "path".
+ */
+int
+daemon_start(const char *path)
+{
+	struct sockaddr_un sun;
+	sigset_t set, oset;
+	pthread_t tid;
+
+	memset(&sun, 0, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof (sun.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return (-1);
+	}
+	(void) strlcpy(sun.sun_path, path, sizeof (sun.sun_path));
+
+	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenfd < 0) {
+		perror("socket");
+		return (-1);
+	}
+	(void) unlink(path);
+	if (bind(listenfd, (struct sockaddr *)&sun, sizeof (sun)) != 0) {
+		perror("bind");
+		return (-1);
+	}
+	(void) strlcpy(sockpath, path, sizeof (sockpath));
+	(void) atexit(daemon_unlink);
+	if (listen(listenfd, 8) != 0) {
+		perror("listen");
+		return (-1);
+	}
+
+	/* Clients going away shouldn't kill us. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Leave SIGINT and the snapshot ticks to the main thread. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	if (pthread_create(&tid, NULL, daemon_thread, NULL) != 0) {
+		perror("pthread_create");
+		return (-1);
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	(void) pthread_detach(tid);
+	return (0);
+}
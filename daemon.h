@@ -0,0 +1,59 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+#if !defined(_DAEMON_H)
+#define _DAEMON_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "window.h"
+#include "client.h"
+
+/*
+ * Publish a new snapshot at most this often, in seconds of both capture time
+ * and real time.
+ */
+#define	SNAP_INTERVAL	1
+
+struct snaprow {
+	uint32_t sr_src;
+	uint32_t sr_dst;
+	uint64_t sr_conns;		/* all-time totals */
+	uint64_t sr_dns;
+	uint32_t sr_wconns[NWINDOWS];
+	uint32_t sr_wdns[NWINDOWS];
+	size_t sr_name;			/* offset into sn_names */
+};
+
+/*
+ * An immutable copy of the aggregates, built by the parser thread and read
+ * by the query thread. Reference counted, so that the parser can publish a
+ * new one without waiting for queries on the old one to finish.
+ */
+struct snapshot {
+	int sn_refs;
+	uint32_t sn_time;		/* capture time it was taken at */
+	uint64_t sn_packets;		/* records read so far */
+	struct snaprow *sn_rows;
+	int sn_nrows;
+	int sn_rowsize;
+	char *sn_names;
+	size_t sn_nameslen;
+	size_t sn_namessize;
+	struct client *sn_clients;	/* copies, without their requests */
+	int sn_nclients;
+};
+
+struct snapshot *snap_new(uint32_t time, uint64_t packets);
+struct snaprow *snap_add(struct snapshot *sn, const char *name);
+void snap_add_clients(struct snapshot *sn);
+void snap_publish(struct snapshot *sn);
+int daemon_start(const char *path);
+
+#endif
@@ -0,0 +1,729 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * Decompression of gzip (and, if built with HAVE_ZSTD, zstd) captures.
+ *
+ * In the normal streaming mode the compressed input is pulled through
+ * input_raw_read() and decompressed a buffer at a time straight into the
+ * record parser's buffer.
+ *
+ * In parallel mode (-j) the file is mapped and cut into segments at gzip
+ * member or zstd frame boundaries, which are decompressed by a pool of
+ * worker threads and handed back to the parser in order. zstd frame
+ * boundaries can be found exactly by walking the frame headers, but gzip
+ * members have no index: we guess at them by looking for gzip headers and
+ * then check each guess against where the previous segment's last member
+ * actually ended. Where a guess turns out to be wrong, the parser thread
+ * decompresses the gap itself ("bridging") until it lands on a member
+ * boundary that some later segment starts at. A single-member gzip file
+ * therefore works, but gets no speedup.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#include "input.h"
+#include "decomp.h"
+
+#define	DC_INBUFSZ	(256 * 1024)
+#define	DC_CHUNKSZ	(1024 * 1024)
+/* Max decompressed chunks buffered per segment before its worker waits. */
+#define	DC_SEGCHUNKS	8
+/* Roughly how big to cut segments (compressed). */
+#define	DC_SEGSZ	(1024 * 1024)
+
+/* A decompressor for one stream of gzip members or zstd frames. */
+struct dcstream {
+	enum dckind ds_kind;
+	const uint8_t *ds_in;		/* compressed input not yet consumed */
+	size_t ds_inlen;
+	int ds_inmember;		/* part-way through a member/frame */
+	int ds_trailing;		/* hit trailing non-compressed data */
+	z_stream ds_z;
+#if defined(HAVE_ZSTD)
+	ZSTD_DStream *ds_zstd;
+#endif
+};
+
+struct dchunk {
+	struct dchunk *next;
+	size_t len;
+	uint8_t data[DC_CHUNKSZ];
+};
+
+enum sgstate {
+	SG_PENDING = 0,
+	SG_RUNNING,
+	SG_DONE,
+	SG_FAILED
+};
+
+/* A range of the compressed file, decompressed by one worker. */
+struct dcseg {
+	size_t sg_start;		/* offset of first member/frame */
+	size_t sg_end;			/* stop at first member end past this */
+	size_t sg_actual;		/* where decompression actually stopped */
+	enum sgstate sg_state;
+	int sg_cancel;
+	int sg_nchunks;
+	struct dchunk *sg_head;
+	struct dchunk *sg_tail;
+};
+
+struct dcpar {
+	enum dckind dp_kind;
+	const uint8_t *dp_map;
+	size_t dp_size;
+	int dp_window;			/* segments workers may run ahead */
+	pthread_mutex_t dp_lock;
+	pthread_cond_t dp_cv;
+	struct dcseg *dp_segs;
+	int dp_nsegs;
+	int dp_next;			/* next segment for a worker to take */
+
+	/* Consumer (parser thread) state. */
+	int dp_cur;			/* segment being read */
+	size_t dp_pos;			/* compressed offset we've reached */
+	struct dchunk *dp_chunk;	/* chunk being read */
+	size_t dp_choff;
+	int dp_bridging;
+	struct dcstream dp_bridge;
+};
+
+struct decomp {
+	struct dcstream dc_ds;		/* streaming mode */
+	struct input *dc_in;
+	uint8_t *dc_ibuf;
+	int dc_ieof;
+	struct dcpar *dc_par;		/* parallel mode */
+};
+
+enum dckind
+decomp_detect(const uint8_t *data, size_t len)
+{
+	if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+		return (DC_GZIP);
+	/* zstd frames, and zstd skippable frames (0x184D2A5?). */
+	if (len >= 4 && data[0] == 0x28 && data[1] == 0xb5 &&
+	    data[2] == 0x2f && data[3] == 0xfd)
+		return (DC_ZSTD);
+	if (len >= 4 && (data[0] & 0xf0) == 0x50 && data[1] == 0x2a &&
+	    data[2] == 0x4d && data[3] == 0x18)
+		return (DC_ZSTD);
+	return (DC_NONE);
+}
+
+const char *
+decomp_name(enum dckind kind)
+{
+	switch (kind) {
+	case DC_GZIP:
+		return ("gzip");
+	case DC_ZSTD:
+		return ("zstd");
+	default:
+		return ("uncompressed");
+	}
+}
+
+int
+decomp_supported(enum dckind kind)
+{
+#if defined(HAVE_ZSTD)
+	return (kind == DC_GZIP || kind == DC_ZSTD);
+#else
+	return (kind == DC_GZIP);
+#endif
+}
+
+static void
+ds_init(struct dcstream *ds, enum dckind kind)
+{
+	memset(ds, 0, sizeof (*ds));
+	ds->ds_kind = kind;
+	if (kind == DC_GZIP) {
+		if (inflateInit2(&ds->ds_z, 16 + MAX_WBITS) != Z_OK) {
+			fprintf(stderr, "failed to initialise zlib\n");
+			exit(2);
+		}
+	}
+#if defined(HAVE_ZSTD)
+	if (kind == DC_ZSTD) {
+		ds->ds_zstd = ZSTD_createDStream();
+		if (ds->ds_zstd == NULL) {
+			fprintf(stderr, "failed to initialise zstd\n");
+			exit(2);
+		}
+		(void) ZSTD_initDStream(ds->ds_zstd);
+	}
+#endif
+}
+
+static void
+ds_fini(struct dcstream *ds)
+{
+	if (ds->ds_kind == DC_GZIP)
+		(void) inflateEnd(&ds->ds_z);
+#if defined(HAVE_ZSTD)
+	if (ds->ds_kind == DC_ZSTD)
+		(void) ZSTD_freeDStream(ds->ds_zstd);
+#endif
+}
+
+/*
+ * Decompress as much of ds_in as fits into "out". Stops early at the end of
+ * each gzip member or zstd frame (setting *memberend), so that callers can
+ * tell where the boundaries are. Anything other than the start of another
+ * member where one should begin is treated as trailing junk, and ends the
+ * stream (as gzip(1) does).
+ *
+ * Returns 0 on success or -1 if the data is corrupt.
+ */
+static int
+ds_run(struct dcstream *ds, uint8_t *out, size_t outlen, size_t *produced,
+    int *memberend)
+{
+	size_t used;
+	int r;
+
+	*produced = 0;
+	*memberend = 0;
+	if (ds->ds_inlen == 0 || ds->ds_trailing)
+		return (0);
+
+	if (!ds->ds_inmember) {
+		if (decomp_detect(ds->ds_in, ds->ds_inlen) != ds->ds_kind) {
+			ds->ds_trailing = 1;
+			return (0);
+		}
+		ds->ds_inmember = 1;
+	}
+
+	if (ds->ds_kind == DC_GZIP) {
+		ds->ds_z.next_in = (Bytef *)ds->ds_in;
+		ds->ds_z.avail_in = ds->ds_inlen;
+		ds->ds_z.next_out = out;
+		ds->ds_z.avail_out = outlen;
+		r = inflate(&ds->ds_z, Z_NO_FLUSH);
+		used = ds->ds_inlen - ds->ds_z.avail_in;
+		*produced = outlen - ds->ds_z.avail_out;
+		ds->ds_in += used;
+		ds->ds_inlen -= used;
+		if (r == Z_STREAM_END) {
+			(void) inflateReset(&ds->ds_z);
+			ds->ds_inmember = 0;
+			*memberend = 1;
+		} else if (r != Z_OK && r != Z_BUF_ERROR) {
+			return (-1);
+		}
+		return (0);
+	}
+
+#if defined(HAVE_ZSTD)
+	if (ds->ds_kind == DC_ZSTD) {
+		ZSTD_inBuffer zin = { ds->ds_in, ds->ds_inlen, 0 };
+		ZSTD_outBuffer zout = { out, outlen, 0 };
+		size_t zr;
+
+		zr = ZSTD_decompressStream(ds->ds_zstd, &zout, &zin);
+		if (ZSTD_isError(zr))
+			return (-1);
+		ds->ds_in += zin.pos;
+		ds->ds_inlen -= zin.pos;
+		*produced = zout.pos;
+		if (zr == 0) {
+			ds->ds_inmember = 0;
+			*memberend = 1;
+		}
+		return (0);
+	}
+#endif
+
+	return (-1);
+}
+
+/*
+ * Start streaming decompression of "in". "peek" holds any bytes already
+ * read off the front of the input to detect its type.
+ */
+struct decomp *
+decomp_start(struct input *in, enum dckind kind, const uint8_t *peek,
+    size_t peeklen)
+{
+	struct decomp *dc;
+
+	dc = calloc(sizeof (*dc), 1);
+	dc->dc_in = in;
+	dc->dc_ibuf = malloc(DC_INBUFSZ);
+	ds_init(&dc->dc_ds, kind);
+	memcpy(dc->dc_ibuf, peek, peeklen);
+	dc->dc_ds.ds_in = dc->dc_ibuf;
+	dc->dc_ds.ds_inlen = peeklen;
+	return (dc);
+}
+
+static ssize_t
+dc_stream_read(struct decomp *dc, uint8_t *buf, size_t len)
+{
+	struct dcstream *ds = &dc->dc_ds;
+	size_t produced;
+	int memberend;
+	ssize_t n;
+
+	for (;;) {
+		/* Keep enough buffered to recognise the next member header. */
+		if (ds->ds_inlen < 4 && !dc->dc_ieof && !ds->ds_trailing) {
+			memmove(dc->dc_ibuf, ds->ds_in, ds->ds_inlen);
+			ds->ds_in = dc->dc_ibuf;
+			n = input_raw_read(dc->dc_in,
+			    dc->dc_ibuf + ds->ds_inlen,
+			    DC_INBUFSZ - ds->ds_inlen);
+			if (n < 0)
+				return (-1);
+			if (n == 0)
+				dc->dc_ieof = 1;
+			ds->ds_inlen += n;
+		}
+
+		if (ds_run(ds, buf, len, &produced, &memberend) != 0) {
+			fprintf(stderr, "corrupt %s input\n",
+			    decomp_name(ds->ds_kind));
+			return (-1);
+		}
+		if (produced > 0)
+			return (produced);
+
+		if (ds->ds_trailing || (dc->dc_ieof && ds->ds_inlen == 0)) {
+			if (ds->ds_inmember) {
+				fprintf(stderr, "truncated %s input\n",
+				    decomp_name(ds->ds_kind));
+				return (-1);
+			}
+			return (0);
+		}
+	}
+}
+
+/*
+ * Find where to cut the mapped file into about "nseg" segments. For zstd we
+ * walk the frame headers to find real frame boundaries; for gzip we look for
+ * something that looks like a gzip member header, which the workers then
+ * verify.
+ */
+static void
+dp_plan(struct dcpar *dp, int nseg)
+{
+	const uint8_t *m = dp->dp_map, *p;
+	size_t size = dp->dp_size;
+	size_t target, off, last = 0;
+	int k;
+
+	dp->dp_segs = calloc(sizeof (struct dcseg), nseg);
+	dp->dp_segs[0].sg_start = 0;
+	dp->dp_nsegs = 1;
+
+#if defined(HAVE_ZSTD)
+	if (dp->dp_kind == DC_ZSTD) {
+		size_t fsz;
+
+		k = 1;
+		off = 0;
+		while (off < size && k < nseg) {
+			fsz = ZSTD_findFrameCompressedSize(m + off, size - off);
+			if (ZSTD_isError(fsz) || fsz == 0)
+				break;
+			off += fsz;
+			target = (size / nseg) * k;
+			if (off >= target && off < size) {
+				dp->dp_segs[dp->dp_nsegs++].sg_start = off;
+				while (k < nseg && (size / nseg) * k <= off)
+					++k;
+			}
+		}
+	}
+#endif
+
+	if (dp->dp_kind == DC_GZIP) {
+		for (k = 1; k < nseg; ++k) {
+			target = (size / nseg) * k;
+			if (target <= last)
+				continue;
+			for (off = target; off + 10 < size &&
+			    off < target + size / nseg; ++off) {
+				p = memchr(m + off, 0x1f, size - 10 - off);
+				if (p == NULL)
+					break;
+				off = p - m;
+				if (off >= target + size / nseg)
+					break;
+				/*
+				 * Magic, deflate, no reserved flag bits, a
+				 * sensible XFL and OS byte.
+				 */
+				if (m[off] != 0x1f || m[off + 1] != 0x8b ||
+				    m[off + 2] != 0x08 ||
+				    (m[off + 3] & 0xe0) != 0)
+					continue;
+				if (m[off + 8] != 0 && m[off + 8] != 2 &&
+				    m[off + 8] != 4)
+					continue;
+				if (m[off + 9] > 13 && m[off + 9] != 255)
+					continue;
+				dp->dp_segs[dp->dp_nsegs++].sg_start = off;
+				last = off;
+				break;
+			}
+		}
+	}
+
+	for (k = 0; k < dp->dp_nsegs; ++k) {
+		dp->dp_segs[k].sg_end = (k + 1 < dp->dp_nsegs) ?
+		    dp->dp_segs[k + 1].sg_start : size;
+	}
+}
+
+/*
+ * Queue a decompressed chunk on its segment, waiting if the segment already
+ * has its fill. Returns -1 if the segment was cancelled meanwhile.
+ */
+static int
+dp_push(struct dcpar *dp, struct dcseg *sg, struct dchunk *ch)
+{
+	pthread_mutex_lock(&dp->dp_lock);
+	while (sg->sg_nchunks >= DC_SEGCHUNKS && !sg->sg_cancel)
+		pthread_cond_wait(&dp->dp_cv, &dp->dp_lock);
+	if (sg->sg_cancel) {
+		pthread_mutex_unlock(&dp->dp_lock);
+		free(ch);
+		return (-1);
+	}
+	ch->next = NULL;
+	if (sg->sg_tail == NULL)
+		sg->sg_head = ch;
+	else
+		sg->sg_tail->next = ch;
+	sg->sg_tail = ch;
+	sg->sg_nchunks++;
+	pthread_cond_broadcast(&dp->dp_cv);
+	pthread_mutex_unlock(&dp->dp_lock);
+	return (0);
+}
+
+static void
+dp_finish(struct dcpar *dp, struct dcseg *sg, enum sgstate state,
+    size_t actual)
+{
+	pthread_mutex_lock(&dp->dp_lock);
+	sg->sg_state = state;
+	sg->sg_actual = actual;
+	pthread_cond_broadcast(&dp->dp_cv);
+	pthread_mutex_unlock(&dp->dp_lock);
+}
+
+/*
+ * Decompress one segment: from its start, through whole members, until the
+ * first member that ends at or past sg_end.
+ */
+static void
+dp_run_segment(struct dcpar *dp, struct dcseg *sg)
+{
+	struct dcstream ds;
+	struct dchunk *ch = NULL;
+	size_t produced, pos;
+	int memberend, stop = 0;
+
+	ds_init(&ds, dp->dp_kind);
+	ds.ds_in = dp->dp_map + sg->sg_start;
+	ds.ds_inlen = dp->dp_size - sg->sg_start;
+
+	while (!stop) {
+		if (ch == NULL) {
+			ch = malloc(sizeof (*ch));
+			ch->len = 0;
+		}
+		if (ds_run(&ds, ch->data + ch->len, DC_CHUNKSZ - ch->len,
+		    &produced, &memberend) != 0) {
+			free(ch);
+			ds_fini(&ds);
+			dp_finish(dp, sg, SG_FAILED, 0);
+			return;
+		}
+		ch->len += produced;
+		pos = ds.ds_in - dp->dp_map;
+
+		if (memberend && pos >= sg->sg_end)
+			stop = 1;
+		if (ds.ds_trailing || ds.ds_inlen == 0) {
+			if (ds.ds_inmember) {
+				free(ch);
+				ds_fini(&ds);
+				dp_finish(dp, sg, SG_FAILED, 0);
+				return;
+			}
+			stop = 1;
+		}
+
+		if (ch->len == DC_CHUNKSZ || (stop && ch->len > 0)) {
+			if (dp_push(dp, sg, ch) != 0) {
+				ds_fini(&ds);
+				return;
+			}
+			ch = NULL;
+		}
+	}
+	free(ch);
+	ds_fini(&ds);
+	dp_finish(dp, sg, SG_DONE, ds.ds_in - dp->dp_map);
+}
+
+static void *
+dp_worker(void *arg)
+{
+	struct dcpar *dp = arg;
+	struct dcseg *sg;
+
+	pthread_mutex_lock(&dp->dp_lock);
+	for (;;) {
+		while (dp->dp_next < dp->dp_nsegs &&
+		    (dp->dp_next < dp->dp_cur ||
+		    dp->dp_segs[dp->dp_next].sg_cancel))
+			dp->dp_next++;
+		if (dp->dp_next >= dp->dp_nsegs)
+			break;
+		if (dp->dp_next >= dp->dp_cur + dp->dp_window) {
+			pthread_cond_wait(&dp->dp_cv, &dp->dp_lock);
+			continue;
+		}
+		sg = &dp->dp_segs[dp->dp_next++];
+		sg->sg_state = SG_RUNNING;
+		pthread_mutex_unlock(&dp->dp_lock);
+		dp_run_segment(dp, sg);
+		pthread_mutex_lock(&dp->dp_lock);
+	}
+	pthread_mutex_unlock(&dp->dp_lock);
+	return (NULL);
+}
+
+/*
+ * Start decompressing the file open on "fd" with "nthreads" worker threads.
+ * Returns NULL if the file can't be mapped (e.g. it's a pipe).
+ */
+struct decomp *
+decomp_start_parallel(int fd, enum dckind kind, int nthreads)
+{
+	struct decomp *dc;
+	struct dcpar *dp;
+	struct stat st;
+	pthread_t tid;
+	void *map;
+	int i, nseg;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return (NULL);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return (NULL);
+
+	dp = calloc(sizeof (*dp), 1);
+	dp->dp_kind = kind;
+	dp->dp_map = map;
+	dp->dp_size = st.st_size;
+	dp->dp_window = nthreads * 2;
+	pthread_mutex_init(&dp->dp_lock, NULL);
+	pthread_cond_init(&dp->dp_cv, NULL);
+
+	nseg = dp->dp_size / DC_SEGSZ;
+	if (nseg < 1)
+		nseg = 1;
+	dp_plan(dp, nseg);
+
+	for (i = 0; i < nthreads; ++i) {
+		if (pthread_create(&tid, NULL, dp_worker, dp) != 0) {
+			perror("pthread_create");
+			exit(2);
+		}
+		(void) pthread_detach(tid);
+	}
+
+	dc = calloc(sizeof (*dc), 1);
+	dc->dc_par = dp;
+	return (dc);
+}
+
+/* Is there a segment at or after dp_cur starting exactly at "pos"? */
+static int
+dp_seg_at(struct dcpar *dp, size_t pos)
+{
+	int k;
+
+	for (k = dp->dp_cur; k < dp->dp_nsegs; ++k) {
+		if (dp->dp_segs[k].sg_start == pos)
+			return (1);
+		if (dp->dp_segs[k].sg_start > pos)
+			break;
+	}
+	return (0);
+}
+
+/* Decompress straight from the map ourselves, from dp_pos onwards. */
+static ssize_t
+dp_bridge_read(struct dcpar *dp, uint8_t *buf, size_t len)
+{
+	struct dcstream *ds = &dp->dp_bridge;
+	size_t produced;
+	int memberend;
+
+	for (;;) {
+		if (ds_run(ds, buf, len, &produced, &memberend) != 0) {
+			fprintf(stderr, "corrupt %s input\n",
+			    decomp_name(dp->dp_kind));
+			return (-1);
+		}
+		dp->dp_pos = ds->ds_in - dp->dp_map;
+		if (memberend) {
+			pthread_mutex_lock(&dp->dp_lock);
+			if (dp_seg_at(dp, dp->dp_pos)) {
+				dp->dp_bridging = 0;
+				ds_fini(ds);
+			}
+			pthread_mutex_unlock(&dp->dp_lock);
+		}
+		if (produced > 0 || !dp->dp_bridging)
+			return (produced);
+		if (ds->ds_trailing || ds->ds_inlen == 0) {
+			if (ds->ds_inmember) {
+				fprintf(stderr, "truncated %s input\n",
+				    decomp_name(dp->dp_kind));
+				return (-1);
+			}
+			dp->dp_bridging = 0;
+			dp->dp_pos = dp->dp_size;
+			ds_fini(ds);
+			return (0);
+		}
+	}
+}
+
+static ssize_t
+dc_parallel_read(struct decomp *dc, uint8_t *buf, size_t len)
+{
+	struct dcpar *dp = dc->dc_par;
+	struct dcseg *sg;
+	struct dchunk *ch;
+	size_t n;
+	ssize_t r;
+
+	for (;;) {
+		if ((ch = dp->dp_chunk) != NULL) {
+			n = ch->len - dp->dp_choff;
+			if (n > len)
+				n = len;
+			memcpy(buf, ch->data + dp->dp_choff, n);
+			dp->dp_choff += n;
+			if (dp->dp_choff == ch->len) {
+				free(ch);
+				dp->dp_chunk = NULL;
+				dp->dp_choff = 0;
+			}
+			return (n);
+		}
+
+		if (dp->dp_bridging) {
+			r = dp_bridge_read(dp, buf, len);
+			if (r != 0 || dp->dp_bridging)
+				return (r);
+			continue;
+		}
+
+		if (dp->dp_pos >= dp->dp_size)
+			return (0);
+
+		pthread_mutex_lock(&dp->dp_lock);
+
+		/*
+		 * Skip (and cancel) any segments that start before where we
+		 * are: they began at something that only looked like a gzip
+		 * header.
+		 */
+		while (dp->dp_cur < dp->dp_nsegs &&
+		    dp->dp_segs[dp->dp_cur].sg_start < dp->dp_pos) {
+			sg = &dp->dp_segs[dp->dp_cur++];
+			sg->sg_cancel = 1;
+			while ((ch = sg->sg_head) != NULL) {
+				sg->sg_head = ch->next;
+				free(ch);
+			}
+			sg->sg_tail = NULL;
+			sg->sg_nchunks = 0;
+			pthread_cond_broadcast(&dp->dp_cv);
+		}
+
+		if (dp->dp_cur >= dp->dp_nsegs ||
+		    dp->dp_segs[dp->dp_cur].sg_start != dp->dp_pos) {
+			pthread_mutex_unlock(&dp->dp_lock);
+			ds_init(&dp->dp_bridge, dp->dp_kind);
+			dp->dp_bridge.ds_in = dp->dp_map + dp->dp_pos;
+			dp->dp_bridge.ds_inlen = dp->dp_size - dp->dp_pos;
+			dp->dp_bridging = 1;
+			continue;
+		}
+
+		sg = &dp->dp_segs[dp->dp_cur];
+		while (sg->sg_head == NULL && sg->sg_state != SG_DONE &&
+		    sg->sg_state != SG_FAILED)
+			pthread_cond_wait(&dp->dp_cv, &dp->dp_lock);
+
+		if (sg->sg_head != NULL) {
+			dp->dp_chunk = sg->sg_head;
+			sg->sg_head = dp->dp_chunk->next;
+			if (sg->sg_head == NULL)
+				sg->sg_tail = NULL;
+			sg->sg_nchunks--;
+			pthread_cond_broadcast(&dp->dp_cv);
+			pthread_mutex_unlock(&dp->dp_lock);
+			continue;
+		}
+
+		if (sg->sg_state == SG_FAILED) {
+			/* It started where the last member ended: real. */
+			pthread_mutex_unlock(&dp->dp_lock);
+			fprintf(stderr, "corrupt %s input\n",
+			    decomp_name(dp->dp_kind));
+			return (-1);
+		}
+
+		dp->dp_pos = sg->sg_actual;
+		dp->dp_cur++;
+		pthread_cond_broadcast(&dp->dp_cv);
+		pthread_mutex_unlock(&dp->dp_lock);
+	}
+}
+
+/*
+ * Read up to "len" bytes of decompressed input. Returns the number of bytes
+ * read, 0 at end of input or -1 on error.
+ */
+ssize_t
+decomp_read(struct decomp *dc, uint8_t *buf, size_t len)
+{
+	if (dc->dc_par != NULL)
+		return (dc_parallel_read(dc, buf, len));
+	return (dc_stream_read(dc, buf, len));
+}
@@ -0,0 +1,33 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+#if !defined(_DECOMP_H)
+#define _DECOMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct input;
+struct decomp;
+
+enum dckind {
+	DC_NONE = 0,
+	DC_GZIP,
+	DC_ZSTD
+};
+
+enum dckind decomp_detect(const uint8_t *data, size_t len);
+const char *decomp_name(enum dckind kind);
+int decomp_supported(enum dckind kind);
+struct decomp *decomp_start(struct input *in, enum dckind kind,
+    const uint8_t *peek, size_t peeklen);
+struct decomp *decomp_start_parallel(int fd, enum dckind kind, int nthreads);
+ssize_t decomp_read(struct decomp *dc, uint8_t *buf, size_t len);
+
+#endif
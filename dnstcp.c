@@ -0,0 +1,268 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * Reassembly of DNS-over-TCP streams (RFC 7766), so that queries retried over
+ * TCP after a truncated UDP response still get attributed.
+ *
+ * Each direction of a port 53 connection is tracked separately from its SYN
+ * onwards. Only in-order data is accepted: retransmitted bytes are trimmed,
+ * and a gap (a lost or reordered segment) abandons the stream, since without
+ * the missing bytes we can't find the next message boundary anyway. Each
+ * complete length-prefixed message is handed to parse_dns().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "enums.h"
+#include "hash.h"
+#include "addr.h"
+#include "packet.h"
+#include "loss.h"
+#include "client.h"
+
+/* A DNS message is at most 64k, plus its 2-byte length prefix. */
+#define	DNSFLOW_MAXBUF		(2 + 65535)
+/* Total buffer memory across all streams. */
+#define	DNSFLOW_MAXMEM		(4 * 1024 * 1024)
+/* Maximum number of half-streams tracked at once. */
+#define	DNSFLOW_MAXFLOWS	4096
+/* Streams idle for this many seconds are dropped by clean_dns_tcp(). */
+#define	DNSFLOW_TIMEOUT		10
+
+struct dnsflow {
+	struct dnsflow *next;
+	struct client *client;		/* who pays for it, if we know them */
+	uint32_t src;			/* sender of this half of the stream */
+	uint32_t dst;
+	uint16_t sport;
+	uint16_t dport;
+	uint32_t nextseq;		/* seq number of next byte expected */
+	uint32_t atime;			/* hdr.sec of last activity */
+	uint32_t len;			/* bytes of buf in use */
+	uint32_t size;			/* bytes of buf allocated */
+	uint8_t *buf;
+};
+/*
+ * Half-streams of DNS-over-TCP connections we're reassembling, hashed on
+ * src,dst,sport,dport of the sending side.
+ */
+static struct dnsflow *dnsflows[BUCKETS] = { NULL };
+static size_t dnsflow_mem = 0;
+static int dnsflow_count = 0;
+
+static struct dnsflow *
+find_flow(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    int unlink)
+{
+	int h;
+	struct dnsflow *pf, *f;
+
+	h = thash(src, dst, sport, dport);
+	for (pf = NULL, f = dnsflows[h]; f != NULL; pf = f, f = f->next) {
+		if (f->src == src && f->dst == dst && f->sport == sport &&
+		    f->dport == dport) {
+			if (unlink) {
+				if (pf == NULL)
+					dnsflows[h] = f->next;
+				else
+					pf->next = f->next;
+			}
+			return (f);
+		}
+	}
+	return (NULL);
+}
+
+static void
+free_flow(struct dnsflow *f)
+{
+	if (f->client != NULL)
+		client_release(f->client, sizeof (*f) + f->size);
+	addr_release(f->src);
+	addr_release(f->dst);
+	dnsflow_mem -= f->size;
+	dnsflow_count--;
+	free(f->buf);
+	free(f);
+}
+
+static void
+drop_flow(struct dnsflow *f)
+{
+	(void) find_flow(f->src, f->dst, f->sport, f->dport, 1);
+	free_flow(f);
+}
+
+/*
+ * Append in-order stream data to a flow's buffer. Returns 0 on success, or
+ * -1 if it would take the flow over its memory limits.
+ */
+static int
+append_flow(struct dnsflow *f, const uint8_t *data, uint32_t len)
+{
+	uint32_t nsize;
+	uint8_t *nbuf;
+
+	if (f->len + len > DNSFLOW_MAXBUF)
+		return (-1);
+	if (f->len + len > f->size) {
+		nsize = (f->size == 0) ? 512 : f->size;
+		while (nsize < f->len + len)
+			nsize *= 2;
+		if (nsize > DNSFLOW_MAXBUF)
+			nsize = DNSFLOW_MAXBUF;
+		if (dnsflow_mem + (nsize - f->size) > DNSFLOW_MAXMEM)
+			return (-1);
+		if (f->client != NULL &&
+		    client_charge(f->client, nsize - f->size) != 0)
+			return (-1);
+		nbuf = realloc(f->buf, nsize);
+		if (nbuf == NULL) {
+			if (f->client != NULL)
+				client_release(f->client, nsize - f->size);
+			return (-1);
+		}
+		dnsflow_mem += nsize - f->size;
+		f->buf = nbuf;
+		f->size = nsize;
+	}
+	memcpy(f->buf + f->len, data, len);
+	f->len += len;
+	return (0);
+}
+
+/*
+ * Called by connbal.c for every TCP segment to or from port 53. "data" and
+ * "len" are the segment payload; "trunc" is set if the capture didn't
+ * include all of it.
+ */
+void
+got_dns_tcp(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    uint32_t seq, uint8_t flags, const uint8_t *data, int len, int trunc,
+    uint32_t time, uint32_t usec)
+{
+	struct dnsflow *f;
+	struct client *c;
+	uint32_t skip, mlen, off;
+	uint16_t v;
+	int h;
+
+	if (flags & TCPFL_SYN) {
+		f = find_flow(src, dst, sport, dport, 1);
+		if (f != NULL)
+			free_flow(f);
+		if (dnsflow_count >= DNSFLOW_MAXFLOWS)
+			return;
+		/*
+		 * Charge the stream to the client end, if it's one we
+		 * already know (it has sent us a query we track).
+		 */
+		c = client_find(addr_resolve(dport == 53 ? src : dst, 0), 0);
+		if (c != NULL && client_charge(c, sizeof (*f)) != 0)
+			return;
+		h = thash(src, dst, sport, dport);
+		if ((f = calloc(1, sizeof (*f))) == NULL) {
+			fprintf(stderr, "warning: out of memory for "
+			    "DNS-over-TCP stream, ignoring it\n");
+			if (c != NULL)
+				client_release(c, sizeof (*f));
+			return;
+		}
+		f->client = c;
+		f->src = src;
+		f->dst = dst;
+		addr_hold(src);
+		addr_hold(dst);
+		f->sport = sport;
+		f->dport = dport;
+		f->nextseq = seq + 1;
+		f->atime = time;
+		f->next = dnsflows[h];
+		dnsflows[h] = f;
+		dnsflow_count++;
+		return;
+	}
+
+	f = find_flow(src, dst, sport, dport, 0);
+	if (f == NULL)
+		return;
+	f->atime = time;
+
+	if (len > 0) {
+		/* Sequence numbers wrap, so compare them as a difference. */
+		if ((int32_t)(seq - f->nextseq) > 0 || trunc) {
+			/*
+			 * Only count the loss if it cut off the answer to a
+			 * query we're tracking; a cut query, or a cut answer
+			 * we weren't tracking, costs us nothing.
+			 */
+			if (trunc && sport == 53 &&
+			    dns_pending(addr_resolve(dst, 0), dport))
+				loss_dns_cut();
+			drop_flow(f);
+			return;
+		}
+		skip = f->nextseq - seq;
+		if (skip < (uint32_t)len) {
+			if (append_flow(f, data + skip, len - skip) != 0) {
+				fprintf(stderr, "warning: DNS-over-TCP stream "
+				    "over memory limit, dropping it\n");
+				drop_flow(f);
+				return;
+			}
+			f->nextseq += len - skip;
+		}
+
+		/* Hand off every complete message we now have. */
+		off = 0;
+		while (f->len - off >= 2) {
+			memcpy(&v, f->buf + off, 2);
+			mlen = ntohs(v);
+			if (f->len - off < 2 + mlen)
+				break;
+			parse_dns(src, dst, sport, dport, f->buf + off + 2,
+			    mlen, time, usec);
+			off += 2 + mlen;
+		}
+		if (off > 0) {
+			memmove(f->buf, f->buf + off, f->len - off);
+			f->len -= off;
+		}
+	}
+
+	if (flags & (TCPFL_FIN | TCPFL_RST))
+		drop_flow(f);
+}
+
+/* Clean out DNS-over-TCP streams that have gone idle. */
+void
+clean_dns_tcp(uint32_t time)
+{
+	int h;
+	struct dnsflow *pf, *nf, *f;
+
+	for (h = 0; h < BUCKETS; ++h) {
+		for (pf = NULL, f = dnsflows[h]; f != NULL; f = nf) {
+			nf = f->next;
+			if (time - f->atime >= DNSFLOW_TIMEOUT) {
+				if (pf == NULL)
+					dnsflows[h] = nf;
+				else
+					pf->next = nf;
+				free_flow(f);
+			} else {
+				pf = f;
+			}
+		}
+	}
+}
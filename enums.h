@@ -10,8 +10,13 @@
 #define _ENUMS_H
 
 enum ipproto {
+	PR_HOPOPT = 0,			/* IPv6 extension headers */
 	PR_TCP = 0x06,
-	PR_UDP = 0x11
+	PR_UDP = 0x11,
+	PR_ROUTING = 43,
+	PR_FRAGMENT = 44,
+	PR_AH = 51,
+	PR_DSTOPTS = 60
 };
 
 enum tcpflag {
@@ -35,6 +40,11 @@ enum nsmeta {
 	NSM_MASK = 0xc0
 };
 
+enum nsflag {
+	NSF_TC = (1<<9),
+	NSF_QR = (1<<15)
+};
+
 enum nsclass {
 	NSC_IN = 0x01,
 	NSC_CS = 0x02,
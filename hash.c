@@ -9,11 +9,12 @@
 #include "hash.h"
 #include <string.h>
 
+#define	FNV_BASIS	0xcbf29ce484222325ULL
+
 static uint64_t
-fnvhash(const uint8_t *data, int len)
+fnvhash_from(uint64_t h, const uint8_t *data, int len)
 {
 	int i;
-	uint64_t h = 0xcbf29ce484222325ULL;
 	for (i = 0; i < len; ++i) {
 		h = h * 0x100000001b3ULL;
 		h = h ^ data[i];
@@ -21,28 +22,47 @@ fnvhash(const uint8_t *data, int len)
 	return (h);
 }
 
+static uint64_t
+fnvhash(const uint8_t *data, int len)
+{
+	return (fnvhash_from(FNV_BASIS, data, len));
+}
+
 int
 shash(const char *target)
 {
 	return (fnvhash((const uint8_t *)target, strlen(target)) % BUCKETS);
 }
 
-int
-dhash(uint32_t src, uint16_t qid)
+uint64_t
+dhash64(uint32_t client, uint16_t qid, uint16_t port)
 {
-	uint8_t data[6];
-	memcpy(data, &src, 4);
+	uint8_t data[8];
+	memcpy(data, &client, 4);
 	memcpy(data + 4, &qid, 2);
-	return (fnvhash(data, 6) % BUCKETS);
+	memcpy(data + 6, &port, 2);
+	return (fnvhash(data, 8));
 }
 
-int
-bhash(uint32_t src, uint32_t dst)
+uint64_t
+bhash64(uint32_t src, uint32_t dst)
 {
 	uint8_t data[8];
 	memcpy(data, &src, 4);
 	memcpy(data + 4, &dst, 4);
-	return (fnvhash(data, 8) % BUCKETS);
+	return (fnvhash(data, 8));
+}
+
+uint64_t
+chash64(uint32_t addr)
+{
+	return (fnvhash((const uint8_t *)&addr, 4));
+}
+
+int
+bhash(uint32_t src, uint32_t dst)
+{
+	return (bhash64(src, dst) % BUCKETS);
 }
 
 int
@@ -55,3 +75,31 @@ thash(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport)
 	memcpy(data + 10, &dport, 2);
 	return (fnvhash(data, 12) % BUCKETS);
 }
+
+int
+nhash(uint32_t src, const char *name)
+{
+	uint64_t h;
+	h = fnvhash((const uint8_t *)&src, 4);
+	h = fnvhash_from(h, (const uint8_t *)name, strlen(name));
+	return (h % BUCKETS);
+}
+
+uint64_t
+synhash(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    uint32_t seq)
+{
+	uint8_t data[16];
+	memcpy(data, &src, 4);
+	memcpy(data + 4, &dst, 4);
+	memcpy(data + 8, &sport, 2);
+	memcpy(data + 10, &dport, 2);
+	memcpy(data + 12, &seq, 4);
+	return (fnvhash(data, 16));
+}
+
+uint64_t
+ahash(const uint8_t *addr)
+{
+	return (fnvhash(addr, 16));
+}
@@ -14,8 +14,14 @@
 #define BUCKETS 512
 
 int shash(const char *target);
-int dhash(uint32_t src, uint16_t qid);
+uint64_t dhash64(uint32_t client, uint16_t qid, uint16_t port);
 int bhash(uint32_t src, uint32_t dst);
+uint64_t bhash64(uint32_t src, uint32_t dst);
+uint64_t chash64(uint32_t addr);
 int thash(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport);
+int nhash(uint32_t src, const char *name);
+uint64_t synhash(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    uint32_t seq);
+uint64_t ahash(const uint8_t *addr);
 
 #endif
@@ -0,0 +1,230 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "input.h"
+#include "readahead.h"
+#include "decomp.h"
+
+void
+input_init(struct input *in, FILE *f)
+{
+	memset(in, 0, sizeof (*in));
+	in->in_file = f;
+	in->in_size = INPUT_BUFSZ;
+	in->in_buf = malloc(in->in_size);
+}
+
+/*
+ * Hand all reads of the underlying file over to a read-ahead thread.
+ */
+void
+input_readahead(struct input *in)
+{
+	in->in_ra = readahead_start(fileno(in->in_file));
+}
+
+/*
+ * Read from the underlying file (or its read-ahead thread), before any
+ * decompression.
+ */
+ssize_t
+input_raw_read(struct input *in, uint8_t *buf, size_t len)
+{
+	/*
+	 * Use read(2) rather than fread() here: on a pipe we want whatever
+	 * snoop has written so far, not to block until the buffer is full.
+	 */
+	if (in->in_ra != NULL)
+		return (readahead_read(in->in_ra, buf, len));
+	return (read(fileno(in->in_file), buf, len));
+}
+
+/*
+ * Look at the first few bytes of the input, and if they're the start of a
+ * compressed stream, set up to decompress it. With "nthreads" > 1 we try
+ * decompressing in parallel, which works only on regular files.
+ *
+ * Returns 0 on success or -1 if the input is in a format we weren't built
+ * to read.
+ */
+int
+input_decompress(struct input *in, int nthreads)
+{
+	enum dckind kind;
+	ssize_t n;
+
+	while (in->in_len < 4) {
+		n = input_raw_read(in, in->in_buf + in->in_len,
+		    4 - in->in_len);
+		if (n <= 0)
+			break;
+		in->in_len += n;
+	}
+
+	kind = decomp_detect(in->in_buf, in->in_len);
+	if (kind == DC_NONE)
+		return (0);
+	if (!decomp_supported(kind)) {
+		fprintf(stderr, "input is %s compressed, but connbal was "
+		    "built without %s support\n", decomp_name(kind),
+		    decomp_name(kind));
+		return (-1);
+	}
+
+	if (nthreads > 1 && in->in_ra == NULL) {
+		in->in_dc = decomp_start_parallel(fileno(in->in_file), kind,
+		    nthreads);
+		if (in->in_dc == NULL) {
+			fprintf(stderr, "warning: can only decompress regular "
+			    "files in parallel\n");
+		}
+	}
+	if (in->in_dc == NULL)
+		in->in_dc = decomp_start(in, kind, in->in_buf, in->in_len);
+	in->in_len = 0;
+	return (0);
+}
+
+/*
+ * Move any unconsumed data down to the start of the buffer, expand the buffer
+ * if the next record won't fit in it, and read as much more as will fit.
+ * This moves the buffer, so it's only done once every record framed from it
+ * is finished with.
+ *
+ * Returns 0 if more data was read, 1 at end of input, and -1 on error.
+ */
+int
+input_fill(struct input *in)
+{
+	ssize_t n;
+	uint32_t reclen;
+	uint8_t *nbuf;
+	size_t nsize;
+
+	/*
+	 * Uncompressed read-ahead input is framed in place, out of the
+	 * read-ahead buffers, so in_buf just follows them around.
+	 */
+	if (in->in_ra != NULL && in->in_dc == NULL) {
+		if (in->in_eof)
+			return (1);
+		n = readahead_view(in->in_ra, &in->in_buf, &in->in_off,
+		    &in->in_len);
+		if (n < 0)
+			return (-1);
+		if (n == 0) {
+			in->in_eof = 1;
+			return (1);
+		}
+		return (0);
+	}
+
+	if (in->in_off > 0) {
+		memmove(in->in_buf, in->in_buf + in->in_off,
+		    in->in_len - in->in_off);
+		in->in_len -= in->in_off;
+		in->in_off = 0;
+	}
+	if (in->in_len >= sizeof (struct pkthdr)) {
+		memcpy(&reclen, in->in_buf + 8, 4);
+		reclen = ntohl(reclen);
+		for (nsize = in->in_size; nsize < reclen; nsize *= 2)
+			;
+		if (nsize > in->in_size) {
+			if ((nbuf = realloc(in->in_buf, nsize)) == NULL) {
+				perror("realloc");
+				return (-1);
+			}
+			in->in_buf = nbuf;
+			in->in_size = nsize;
+		}
+	}
+	if (in->in_eof)
+		return (1);
+
+	if (in->in_dc != NULL) {
+		n = decomp_read(in->in_dc, in->in_buf + in->in_len,
+		    in->in_size - in->in_len);
+	} else {
+		n = input_raw_read(in, in->in_buf + in->in_len,
+		    in->in_size - in->in_len);
+	}
+	if (n < 0)
+		return (-1);
+	if (n == 0) {
+		in->in_eof = 1;
+		return (1);
+	}
+	in->in_len += n;
+	return (0);
+}
+
+int
+input_read_hdr(struct input *in, struct snoophdr *hdr)
+{
+	int r;
+
+	while (in->in_len - in->in_off < sizeof (*hdr)) {
+		if ((r = input_fill(in)) != 0)
+			return (r);
+	}
+	memcpy(hdr, in->in_buf + in->in_off, sizeof (*hdr));
+	in->in_off += sizeof (*hdr);
+	return (0);
+}
+
+/*
+ * Frame the next capture record out of the data already in the buffer,
+ * converting its header to host byte order. Does not read any more input.
+ *
+ * Returns 1 if a record was framed, 0 if the buffer doesn't hold a whole
+ * record (call input_fill() and try again), and -1 if the record is bad.
+ */
+int
+input_frame(struct input *in, struct pkthdr *hdr, const uint8_t **data)
+{
+	size_t avail = in->in_len - in->in_off;
+	uint32_t reclen;
+
+	if (avail < sizeof (*hdr))
+		return (0);
+
+	memcpy(&reclen, in->in_buf + in->in_off + 8, 4);
+	reclen = ntohl(reclen);
+	if (reclen < sizeof (*hdr))
+		return (-1);
+
+	/* input_fill() will make room for it if need be. */
+	if (avail < reclen)
+		return (0);
+
+	memcpy(hdr, in->in_buf + in->in_off, sizeof (*hdr));
+	hdr->len = ntohl(hdr->len);
+	hdr->snap = ntohl(hdr->snap);
+	hdr->reclen = reclen;
+	hdr->drops = ntohl(hdr->drops);
+	hdr->sec = ntohl(hdr->sec);
+	hdr->usec = ntohl(hdr->usec);
+	*data = in->in_buf + in->in_off + sizeof (*hdr);
+
+	/* Never let the payload run past the end of the record. */
+	if (hdr->snap > reclen - sizeof (*hdr))
+		hdr->snap = reclen - sizeof (*hdr);
+
+	in->in_off += reclen;
+	/* Framing is a pointer chase, so start on the next record early. */
+	__builtin_prefetch(in->in_buf + in->in_off + 512);
+	return (1);
+}
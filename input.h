@@ -0,0 +1,64 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+#if !defined(_INPUT_H)
+#define _INPUT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Snoop data structures from RFC1761. Ints are big-endian. */
+
+struct snoophdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t dltype;
+};
+
+struct pkthdr {
+	uint32_t len;
+	uint32_t snap;
+	uint32_t reclen;
+	uint32_t drops;
+	uint32_t sec;
+	uint32_t usec;
+};
+
+struct readahead;
+struct decomp;
+
+/*
+ * A buffered reader over the capture stream. Records are framed directly out
+ * of in_buf, so pointers handed out by input_frame() stay valid until the
+ * next call to input_fill(). With -r and no decompression, in_buf points
+ * into the read-ahead buffers instead (see readahead_view()).
+ */
+struct input {
+	FILE *in_file;
+	struct readahead *in_ra;	/* read-ahead thread, if -r */
+	struct decomp *in_dc;		/* decompressor, if compressed */
+	uint8_t *in_buf;
+	size_t in_size;			/* allocated size of in_buf */
+	size_t in_off;			/* start of unconsumed data */
+	size_t in_len;			/* end of valid data */
+	int in_eof;
+};
+
+#define	INPUT_BUFSZ	(256 * 1024)
+
+void input_init(struct input *in, FILE *f);
+void input_readahead(struct input *in);
+int input_decompress(struct input *in, int nthreads);
+ssize_t input_raw_read(struct input *in, uint8_t *buf, size_t len);
+int input_fill(struct input *in);
+int input_read_hdr(struct input *in, struct snoophdr *hdr);
+int input_frame(struct input *in, struct pkthdr *hdr, const uint8_t **data);
+
+#endif
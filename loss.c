@@ -0,0 +1,142 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * Capture-loss accounting. Everything we don't see skews the counts, so we
+ * keep track of the ways packets go missing:
+ *
+ *  - the "cumulative drops" field in each record header, i.e. packets the
+ *    capturing system lost before they got to the file or pipe;
+ *  - records that were cut off at the snap length (len > snap);
+ *  - DNS answers we were tracking that were cut off before the records we
+ *    needed, and so were only partly counted or not at all;
+ *  - how far behind real time we are, if this is a live capture.
+ *
+ * If drops are going up at the same time as we're falling further behind,
+ * then it's likely that we're the reason packets are being lost (the pipe
+ * from snoop is full), and we say so whether or not -l was given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "loss.h"
+
+extern int lossreport;
+
+/* If we're within this much of real time, assume the capture is live. */
+#define	LIVE_LAG	3600
+
+static uint64_t records = 0;
+static uint64_t truncated = 0;
+static uint64_t dnscut = 0;
+static uint32_t drops = 0;
+static int64_t lag = 0;
+static int64_t maxlag = 0;
+static int live = -1;			/* -1 until we've seen a record */
+
+/* Values at the last check, to report the change since. */
+static uint32_t lasttime = 0;
+static uint64_t lastrecords = 0;
+static uint64_t lasttruncated = 0;
+static uint64_t lastdnscut = 0;
+static uint32_t lastdrops = 0;
+static int64_t lastlag = 0;
+
+/*
+ * Called by connbal.c for every batch of records, interesting or not.
+ */
+void
+loss_batch(const struct pkthdr *hdrs, int n)
+{
+	int i;
+
+	records += n;
+	for (i = 0; i < n; ++i) {
+		if (hdrs[i].len > hdrs[i].snap)
+			truncated++;
+	}
+	/* Drops are cumulative from the start of the capture. */
+	if (n > 0 && hdrs[n - 1].drops > drops)
+		drops = hdrs[n - 1].drops;
+}
+
+/*
+ * A DNS answer we were tracking didn't make it into the capture whole.
+ */
+void
+loss_dns_cut(void)
+{
+	dnscut++;
+}
+
+/*
+ * Called by connbal.c after each batch, with the capture time of the last
+ * record in it.
+ */
+void
+loss_check(uint32_t sec)
+{
+	lag = (int64_t)time(NULL) - sec;
+	if (live == -1) {
+		live = (lag < LIVE_LAG && lag > -LIVE_LAG);
+		lasttime = sec;
+		lastlag = lag;
+	}
+	if (live && lag > maxlag)
+		maxlag = lag;
+
+	if (sec - lasttime < LOSS_INTERVAL)
+		return;
+
+	if (lossreport) {
+		fprintf(stderr, "loss: %llu records, %u dropped, "
+		    "%llu truncated, %llu dns cut",
+		    (unsigned long long)(records - lastrecords),
+		    drops - lastdrops,
+		    (unsigned long long)(truncated - lasttruncated),
+		    (unsigned long long)(dnscut - lastdnscut));
+		if (live)
+			fprintf(stderr, ", %llds behind\n", (long long)lag);
+		else
+			fprintf(stderr, "\n");
+	}
+	/* Allow a little jitter in the lag before blaming ourselves. */
+	if (live && drops > lastdrops && lag > lastlag + 2) {
+		fprintf(stderr, "warning: %u packets dropped while we fell "
+		    "%llds further behind the capture; try -F or a capture "
+		    "filter to reduce the load\n",
+		    drops - lastdrops, (long long)(lag - lastlag));
+	}
+
+	lasttime = sec;
+	lastrecords = records;
+	lasttruncated = truncated;
+	lastdnscut = dnscut;
+	lastdrops = drops;
+	lastlag = lag;
+}
+
+void
+print_loss_summary(void)
+{
+	fprintf(stdout, "# records\tdropped\t%%dropped\ttruncated\t"
+	    "%%truncated\tdns cut\tmax lag\n");
+	fprintf(stdout, "%llu\t%u\t%.2f\t%llu\t%.2f\t%llu\t",
+	    (unsigned long long)records, drops,
+	    (records + drops > 0) ? 100.0 * drops / (records + drops) : 0.0,
+	    (unsigned long long)truncated,
+	    (records > 0) ? 100.0 * truncated / records : 0.0,
+	    (unsigned long long)dnscut);
+	if (live == 1)
+		fprintf(stdout, "%lld\n", (long long)maxlag);
+	else
+		fprintf(stdout, "-\n");
+}
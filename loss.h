@@ -0,0 +1,24 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+#if !defined(_LOSS_H)
+#define _LOSS_H
+
+#include <stdint.h>
+
+#include "input.h"
+
+/* Check for (and with -l, report) loss this often, in capture time. */
+#define	LOSS_INTERVAL	60
+
+void loss_batch(const struct pkthdr *hdrs, int n);
+void loss_dns_cut(void);
+void loss_check(uint32_t sec);
+void print_loss_summary(void);
+
+#endif
@@ -15,38 +15,66 @@
 #include "enums.h"
 #include "hash.h"
 #include "packet.h"
+#include "window.h"
+#include "daemon.h"
+#include "loss.h"
+#include "addr.h"
+#include "client.h"
 
 extern const char *namefilt;
+extern int ttlstats;
+extern int balstats;
+extern int daemonmode;
 
 struct tcpconn {
 	struct tcpconn *next;
+	struct client *client;		/* the client of its backend */
 	uint32_t src;
 	uint32_t dst;
 	uint16_t sport;
 	uint16_t dport;
 };
 /*
- * Hash table of known TCP connections, only used for -a.
+ * Hash table of known TCP connections to backends, only used for -a.
  */
 struct tcpconn *tcpconns[BUCKETS] = { NULL };
 
 struct dnsreq {
-	struct dnsreq *next;
 	uint16_t qid;			/* DNS query id */
 	uint32_t src;			/* source IP of original req */
 	uint32_t dst;
 	uint16_t sport;
+	uint16_t qtype;			/* NST_A, NST_AAAA or NST_SRV */
 	uint32_t ctime;			/* value of snoop hdr.sec at creation */
+	uint32_t cusec;			/* ... and hdr.usec */
+	struct client *client;		/* the client that sent it */
+	struct dnsreq *cprev;		/* the client's other requests, */
+	struct dnsreq *cnext;		/*   oldest first */
 	char name[256];
 };
 /*
  * All DNS requests that are currently outstanding that match our filters,
- * hashed on src,qid.
+ * in an open-addressed index keyed on (client, qid, client port). A response
+ * is looked up here before we decode any of it, so the many responses to
+ * queries we aren't tracking cost only a probe or two. Like bindex below, it
+ * doubles whenever it would get more than half full; removals shift later
+ * entries back rather than leaving tombstones.
  */
-struct dnsreq *dnsreqs[BUCKETS] = { NULL };
+struct dslot {
+	uint64_t key;
+	struct dnsreq *req;		/* NULL if empty */
+};
+
+static struct dslot *dindex = NULL;
+static uint32_t dindexsize = 0;
+static uint32_t ndnsreqs = 0;
+
+#define	DKEY(client, qid, port)	\
+	(((uint64_t)(client) << 32) | ((uint32_t)(qid) << 16) | (port))
 
 struct srvrec {
 	struct srvrec *next;
+	struct client *client;		/* whose answer it came from */
 	char target[256];
 	char name[256];
 	uint16_t ports[16];
@@ -58,24 +86,91 @@ struct srvrec {
  */
 struct srvrec *srvrecs[BUCKETS] = { NULL };
 
-struct backend {
-	struct backend *next;
+/*
+ * Backends that have been seen in DNS, which we are now tracking connections
+ * to. There can be millions of these, so rather than a malloc'd struct each
+ * they live in arrays indexed by a backend id. bhot[] holds only what
+ * got_tcp_syn() needs, so that a SYN touches one small record; names and the
+ * other rarely used fields are in bcold[].
+ */
+struct bhot {
 	uint32_t src;
 	uint32_t dst;
-	uint64_t rcount;
-	char name[256];
-	uint16_t ports[16];		/* unused slots are 0 */
-	uint64_t counts[16];		/* conn count, same index as ports */
-	uint64_t rcounts[16];		/* # of times returned in DNS results */
+	uint64_t conns;			/* sum of the ports' counts */
+	uint64_t rcount;		/* # of times returned in DNS (not SRV) */
+	struct service *svc;		/* for balance metrics */
+	uint32_t port;			/* first port slot, or PORT_NONE */
+	uint32_t nports;
+};
+
+struct bcold {
+	const char *name;		/* interned, see intern_name() */
+	uint32_t cnext;			/* client's next backend id + 1, or 0 */
+	struct wincount *wconns;	/* windowed counts, only with -D */
+	struct wincount *wdns;
+};
+
+static struct bhot *bhot = NULL;
+static struct bcold *bcold = NULL;
+static uint32_t nbackends = 0;
+static uint32_t bsize = 0;
+
+#define	BACKEND_NONE	UINT32_MAX
+
+/*
+ * Per-port counters of a backend, in a shared pool and linked from
+ * bhot.port in the order the ports were first seen.
+ */
+struct portslot {
+	uint32_t next;
+	uint16_t port;
+	uint64_t count;			/* conn count */
+	uint64_t retries;		/* retransmitted SYNs */
+	uint64_t rcount;		/* # of times returned in DNS results */
+};
+
+static struct portslot *pslots = NULL;
+static uint32_t npslots = 0;
+static uint32_t pslotsize = 0;
+
+#define	PORT_NONE	UINT32_MAX
+#define	MAXPORTS	16
+
+/*
+ * Open-addressed index from (src, dst) to backend id. The slots carry the
+ * key too, so a lookup doesn't touch bhot[] at all. It doubles in size
+ * whenever it would get more than half full.
+ */
+struct bslot {
+	uint64_t key;
+	uint32_t id;			/* backend id + 1, or 0 if empty */
 };
+
+static struct bslot *bindex = NULL;
+static uint32_t bindexsize = 0;
+
+/*
+ * What a backend costs, for charging to its client: its records, a share of
+ * the index and of its service's list, one port and (for -D) its windowed
+ * counters.
+ */
+#define	BACKEND_SIZE	(sizeof (struct bhot) + sizeof (struct bcold) + \
+	2 * sizeof (struct bslot) + 2 * sizeof (uint32_t) + \
+	sizeof (struct portslot) + \
+	(daemonmode ? 2 * sizeof (struct wincount) : 0))
+
 /*
- * Actual backends that have been seen in DNS, which we are now tracking
- * connections to.
+ * Backend names. There are only as many of these as services, so each
+ * backend just points at a shared copy.
  */
-struct backend *backends[BUCKETS] = { NULL };
+struct bname {
+	struct bname *next;
+	char name[1];
+};
+struct bname *bnames[BUCKETS] = { NULL };
 
 /*
- * Add a port to a port set (like b->ports on a struct backend).
+ * Add a port to a port set (like s->ports on a struct srvrec).
  */
 int
 add_port(uint16_t *ports, uint16_t port)
@@ -94,8 +189,13 @@ add_port(uint16_t *ports, uint16_t port)
 	return (-1);
 }
 
+/*
+ * An answer to client "c" said "target" serves "name" on "port". A new SRV
+ * target is charged to "c".
+ */
 void
-saw_srv_target(const char *target, uint16_t port, const char *name)
+saw_srv_target(struct client *c, const char *target, uint16_t port,
+    const char *name)
 {
 	int h, i, j;
 	struct srvrec *s;
@@ -111,7 +211,10 @@ saw_srv_target(const char *target, uint16_t port, const char *name)
 		}
 	}
 
+	if (client_charge(c, sizeof (*s)) != 0)
+		return;
 	s = calloc(sizeof (*s), 1);
+	s->client = c;
 	strlcpy(s->target, target, sizeof (s->target));
 	strlcpy(s->name, name, sizeof (s->name));
 	s->ports[0] = port;
@@ -134,46 +237,242 @@ find_srv_target(const char *target)
 	return (NULL);
 }
 
-void
-make_backend(uint32_t src, uint32_t dst, const char *name, struct srvrec *srv)
+static const char *
+intern_name(const char *name)
 {
-	int h, i, j;
-	struct backend *b;
+	int h;
+	size_t len;
+	struct bname *n;
 
-	h = bhash(src, dst);
+	h = shash(name);
+	for (n = bnames[h]; n != NULL; n = n->next) {
+		if (strcmp(n->name, name) == 0)
+			return (n->name);
+	}
+	len = strlen(name);
+	n = malloc(sizeof (*n) + len);
+	memcpy(n->name, name, len + 1);
+	n->next = bnames[h];
+	bnames[h] = n;
+	return (n->name);
+}
 
-	for (b = backends[h]; b != NULL; b = b->next) {
-		if (b->src == src && b->dst == dst) {
-			if (srv == NULL) {
-				b->rcount++;
-				return;
-			}
-			for (i = 0; i < 16; ++i) {
-				j = add_port(b->ports, srv->ports[i]);
-				if (j == -1) {
-					fprintf(stderr, "warning: backend "
-					    "for %s is out of ports\n", name);
-					return;
-				}
-				b->rcounts[j]++;
+static void
+bindex_insert(uint64_t key, uint32_t id)
+{
+	uint32_t i, mask = bindexsize - 1;
+
+	i = bhash64(key >> 32, key & UINT32_MAX) & mask;
+	while (bindex[i].id != 0)
+		i = (i + 1) & mask;
+	bindex[i].key = key;
+	bindex[i].id = id + 1;
+}
+
+static void
+bindex_grow(void)
+{
+	struct bslot *old = bindex;
+	uint32_t i, oldsize = bindexsize;
+
+	bindexsize = (oldsize == 0) ? 1024 : oldsize * 2;
+	bindex = calloc(bindexsize, sizeof (*bindex));
+	for (i = 0; i < oldsize; ++i) {
+		if (old[i].id != 0)
+			bindex_insert(old[i].key, old[i].id - 1);
+	}
+	free(old);
+}
+
+static uint32_t
+find_backend(uint32_t src, uint32_t dst)
+{
+	uint64_t key = ((uint64_t)src << 32) | dst;
+	uint32_t i, mask = bindexsize - 1;
+
+	if (bindexsize == 0)
+		return (BACKEND_NONE);
+	i = bhash64(src, dst) & mask;
+	while (bindex[i].id != 0) {
+		if (bindex[i].key == key)
+			return (bindex[i].id - 1);
+		i = (i + 1) & mask;
+	}
+	return (BACKEND_NONE);
+}
+
+static uint32_t
+new_backend(uint32_t src, uint32_t dst)
+{
+	uint32_t id = nbackends++;
+
+	if (nbackends > bsize) {
+		bsize = (bsize == 0) ? 1024 : bsize * 2;
+		bhot = realloc(bhot, bsize * sizeof (*bhot));
+		bcold = realloc(bcold, bsize * sizeof (*bcold));
+	}
+	if (nbackends * 2 > bindexsize)
+		bindex_grow();
+	bindex_insert(((uint64_t)src << 32) | dst, id);
+
+	memset(&bhot[id], 0, sizeof (*bhot));
+	memset(&bcold[id], 0, sizeof (*bcold));
+	bhot[id].src = src;
+	bhot[id].dst = dst;
+	bhot[id].port = PORT_NONE;
+	return (id);
+}
+
+/*
+ * Find the slot for "port" on backend "id", adding it if it's new. Returns
+ * PORT_NONE if the backend already has MAXPORTS other ports.
+ */
+static uint32_t
+backend_port(uint32_t id, uint16_t port)
+{
+	struct bhot *b = &bhot[id];
+	uint32_t s, last = PORT_NONE;
+
+	for (s = b->port; s != PORT_NONE; s = pslots[s].next) {
+		if (pslots[s].port == port)
+			return (s);
+		last = s;
+	}
+	if (b->nports >= MAXPORTS)
+		return (PORT_NONE);
+
+	if (npslots == pslotsize) {
+		pslotsize = (pslotsize == 0) ? 1024 : pslotsize * 2;
+		pslots = realloc(pslots, pslotsize * sizeof (*pslots));
+	}
+	s = npslots++;
+	memset(&pslots[s], 0, sizeof (*pslots));
+	pslots[s].next = PORT_NONE;
+	pslots[s].port = port;
+	if (last == PORT_NONE)
+		b->port = s;
+	else
+		pslots[last].next = s;
+	b->nports++;
+	return (s);
+}
+
+/* All the connections made to a backend, on any port. */
+uint64_t
+backend_conns(uint32_t id)
+{
+	return (bhot[id].conns);
+}
+
+/*
+ * The number of times a backend has been returned in DNS: for SRV backends,
+ * the most of any of its ports.
+ */
+static uint64_t
+backend_rcount(uint32_t id)
+{
+	uint64_t r = bhot[id].rcount;
+	uint32_t s;
+
+	for (s = bhot[id].port; s != PORT_NONE; s = pslots[s].next) {
+		if (pslots[s].rcount > r)
+			r = pslots[s].rcount;
+	}
+	return (r > 0 ? r : 1);
+}
+
+void
+make_backend(uint32_t src, uint32_t dst, const char *name, struct srvrec *srv,
+    uint32_t time)
+{
+	int i;
+	uint32_t id, s;
+	struct bhot *b;
+	struct client *c;
+	struct service *svc;
+	uint64_t oldr;
+
+	id = find_backend(src, dst);
+	if (id != BACKEND_NONE) {
+		b = &bhot[id];
+		if (daemonmode)
+			win_add(bcold[id].wdns, time, 1);
+		oldr = backend_rcount(id);
+		if (srv == NULL) {
+			b->rcount++;
+			if (addr_is_v6(src) == addr_is_v6(dst)) {
+				svc_returned(b->svc, b->conns, oldr,
+				    backend_rcount(id));
 			}
 			return;
 		}
+		for (i = 0; i < 16 && srv->ports[i] != 0; ++i) {
+			s = backend_port(id, srv->ports[i]);
+			if (s == PORT_NONE) {
+				fprintf(stderr, "warning: backend "
+				    "for %s is out of ports\n", name);
+				break;
+			}
+			pslots[s].rcount++;
+		}
+		if (addr_is_v6(src) == addr_is_v6(dst))
+			svc_returned(b->svc, b->conns, oldr, backend_rcount(id));
+		return;
 	}
-	
-	b = calloc(sizeof (*b), 1);
-	strlcpy(b->name, (srv == NULL ? name : srv->name), sizeof (b->name));
-	b->src = src;
-	b->dst = dst;
-	b->next = backends[h];
+
+	/*
+	 * Backends are kept for good, so a client whose quota is full
+	 * (less the room kept for its requests) doesn't get it. A backend needs its service, which may be new too.
+	 */
+	c = client_find(src, 1);
+	if (client_charge(c, BACKEND_SIZE) != 0)
+		return;
+	name = intern_name(srv == NULL ? name : srv->name);
+	if ((svc = svc_find(src, name)) == NULL) {
+		client_release(c, BACKEND_SIZE);
+		return;
+	}
+	c->c_nbackends++;
+
+	id = new_backend(src, dst);
+	if (c->c_lastb == 0)
+		c->c_firstb = id + 1;
+	else
+		bcold[c->c_lastb - 1].cnext = id + 1;
+	c->c_lastb = id + 1;
+	b = &bhot[id];
+	bcold[id].name = name;
 	if (srv != NULL) {
-		memcpy(b->ports, srv->ports, sizeof (b->ports));
-		for (i = 0; i < 16 && b->ports[i] != 0; ++i)
-			b->rcounts[i] = 1;
+		for (i = 0; i < 16 && srv->ports[i] != 0; ++i) {
+			s = backend_port(id, srv->ports[i]);
+			pslots[s].rcount = 1;
+		}
 	} else {
 		b->rcount = 1;
 	}
-	backends[h] = b;
+	b->svc = svc;
+	/*
+	 * The client's connections to a backend of the other family come
+	 * from its other address, so we'll never see them here.
+	 */
+	if (addr_is_v6(src) != addr_is_v6(dst)) {
+		svc_other_family(svc);
+	} else if (svc_add_backend(svc, id, backend_rcount(id)) != 0) {
+		fprintf(stderr, "warning: out of memory for the backends "
+		    "of %s\n", name);
+	}
+	if (daemonmode) {
+		bcold[id].wconns = calloc(sizeof (struct wincount), 1);
+		bcold[id].wdns = calloc(sizeof (struct wincount), 1);
+		win_add(bcold[id].wdns, time, 1);
+	}
+}
+
+static void
+free_tcpconn(struct tcpconn *c)
+{
+	client_release(c->client, sizeof (*c));
+	free(c);
 }
 
 void
@@ -190,6 +489,7 @@ got_tcp_fin(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport)
 				tcpconns[h] = c->next;
 			else
 				pc->next = c->next;
+			free_tcpconn(c);
 			return;
 		}
 	}
@@ -202,16 +502,20 @@ got_tcp_fin(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport)
 				tcpconns[h] = c->next;
 			else
 				pc->next = c->next;
+			free_tcpconn(c);
 			return;
 		}
 	}
 }
 
 void
-got_tcp(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport)
+got_tcp(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    uint32_t time)
 {
 	int h;
+	uint32_t id;
 	struct tcpconn *c;
+	struct client *cl;
 
 	h = thash(src, dst, sport, dport);
 	for (c = tcpconns[h]; c != NULL; c = c->next) {
@@ -229,8 +533,20 @@ got_tcp(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport)
 		}
 	}
 
+	/*
+	 * Only connections to backends count, so they're all we need to
+	 * remember, and each is charged to its backend's client.
+	 */
+	if ((id = find_backend(src, dst)) == BACKEND_NONE &&
+	    (id = find_backend(dst, src)) == BACKEND_NONE)
+		return;
+	cl = client_find(bhot[id].src, 1);
+	if (client_charge(cl, sizeof (*c)) != 0)
+		return;
+
 	h = thash(src, dst, sport, dport);
 	c = calloc(sizeof (*c), 1);
+	c->client = cl;
 	c->src = src;
 	c->dst = dst;
 	c->sport = sport;
@@ -238,67 +554,154 @@ got_tcp(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport)
 	c->next = tcpconns[h];
 	tcpconns[h] = c;
 
-	got_tcp_syn(src, dst, sport, dport);
-	got_tcp_syn(dst, src, dport, sport);
+	got_tcp_syn(src, dst, sport, dport, time);
+	got_tcp_syn(dst, src, dport, sport, time);
 }
 
 /*
  * Called by connbal.c when any new TCP connection attempt is seen.
  */
 void
-got_tcp_syn(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport)
+got_tcp_syn(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    uint32_t time)
 {
-	int h, i;
-	struct backend *b;
+	uint32_t id, s;
+	struct bhot *b;
 
-	h = bhash(src, dst);
+	id = find_backend(src, dst);
+	if (id == BACKEND_NONE)
+		return;
+	s = backend_port(id, dport);
+	if (s == PORT_NONE) {
+		fprintf(stderr, "warning: backend is out of ports\n");
+		return;
+	}
+	b = &bhot[id];
+	if (balstats)
+		svc_conn(b->svc, b->conns, backend_rcount(id));
+	pslots[s].count++;
+	b->conns++;
+	if (daemonmode)
+		win_add(bcold[id].wconns, time, 1);
+}
 
-	for (b = backends[h]; b != NULL; b = b->next) {
-		if (b->src == src && b->dst == dst) {
-			i = add_port(b->ports, dport);
-			if (i == -1) {
-				fprintf(stderr, "warning: backend is out of "
-				    "ports\n");
-				return;
-			}
-			b->counts[i]++;
-			return;
-		}
+/*
+ * Called by connbal.c instead of got_tcp_syn() when a SYN is a retransmission
+ * of one we've already counted.
+ */
+void
+got_tcp_retry(uint32_t src, uint32_t dst, uint16_t dport)
+{
+	uint32_t id, s;
+
+	id = find_backend(src, dst);
+	if (id == BACKEND_NONE)
+		return;
+	s = backend_port(id, dport);
+	if (s == PORT_NONE)
+		return;
+	pslots[s].retries++;
+}
+
+static void
+print_backend(FILE *out, uint32_t id)
+{
+	char srcs[ADDR_STRLEN], dsts[ADDR_STRLEN + 2];
+	char buf[ADDR_STRLEN];
+	struct bhot *b = &bhot[id];
+	uint32_t s;
+
+	addr_fmt(b->src, srcs);
+	/* IPv6 backends are [addr]:port, so the port stands out. */
+	snprintf(dsts, sizeof (dsts),
+	    addr_is_v6(b->dst) ? "[%s]" : "%s", addr_fmt(b->dst, buf));
+	for (s = b->port; s != PORT_NONE; s = pslots[s].next) {
+		fprintf(out, "%s\t%s:%u\t%llu\t%llu\t%llu\t%s\n",
+		    srcs, dsts, pslots[s].port,
+		    (unsigned long long)pslots[s].count,
+		    (unsigned long long)pslots[s].retries,
+		    (unsigned long long)((b->rcount > 0) ? b->rcount :
+		    pslots[s].rcount), bcold[id].name);
+	}
+	if (b->port == PORT_NONE) {
+		fprintf(out, "%s\t%s:?\t0\t0\t%llu\t%s\n",
+		    srcs, dsts, (unsigned long long)b->rcount,
+		    bcold[id].name);
 	}
 }
 
+/*
+ * Print one line per backend port (or only those of "client", unless it's
+ * ADDR_NONE), in the order the backends were first seen.
+ */
 void
-print_summary(void)
-{
-	int h, i;
-	struct backend *b;
-	for (h = 0; h < BUCKETS; ++h) {
-		for (b = backends[h]; b != NULL; b = b->next) {
-			uint8_t srcb[4], dstb[4];
-			memcpy(srcb, &b->src, 4);
-			memcpy(dstb, &b->dst, 4);
-			for (i = 0; i < 16; ++i) {
-				if (b->ports[i] == 0)
-					continue;
-				fprintf(stdout, "%03u.%03u.%03u.%03u\t"
-				    "%03u.%03u.%03u.%03u:%u\t"
-				    "%llu\t%llu\t%s\n",
-				    srcb[3], srcb[2], srcb[1], srcb[0],
-				    dstb[3], dstb[2], dstb[1], dstb[0],
-				    b->ports[i], b->counts[i],
-				    (b->rcount > 0) ? b->rcount : b->rcounts[i],
-				    b->name);
-			}
-			if (b->ports[0] == 0) {
-				fprintf(stdout, "%03u.%03u.%03u.%03u\t"
-				    "%03u.%03u.%03u.%03u:?\t"
-				    "0\t%llu\t%s\n",
-				    srcb[3], srcb[2], srcb[1], srcb[0],
-				    dstb[3], dstb[2], dstb[1], dstb[0],
-				    b->rcount, b->name);
-			}
+print_summary(FILE *out, uint32_t client)
+{
+	struct client *c;
+	uint32_t id;
+
+	if (client == ADDR_NONE) {
+		for (id = 0; id < nbackends; ++id)
+			print_backend(out, id);
+		return;
+	}
+	if ((c = client_find(client, 0)) == NULL)
+		return;
+	for (id = c->c_firstb; id != 0; id = bcold[id - 1].cnext)
+		print_backend(out, id - 1);
+}
+
+/*
+ * Fill in each client's connection and retry counts from its backends. These
+ * aren't kept up to date as SYNs come in, so as to keep got_tcp_syn() to the
+ * one backend record.
+ */
+void
+tally_clients(void)
+{
+	struct client *c = NULL;
+	uint32_t i, id, s;
+
+	for (i = 0; i < client_count(); ++i) {
+		c = client_get(i);
+		c->c_conns = 0;
+		c->c_retries = 0;
+	}
+	for (id = 0; id < nbackends; ++id) {
+		if (c == NULL || c->c_addr != bhot[id].src)
+			c = client_find(bhot[id].src, 1);
+		c->c_conns += bhot[id].conns;
+		for (s = bhot[id].port; s != PORT_NONE; s = pslots[s].next)
+			c->c_retries += pslots[s].retries;
+	}
+}
+
+/*
+ * Copy the backends into a new snapshot for the daemon's query thread, and
+ * publish it.
+ */
+void
+snapshot_backends(uint32_t time, uint64_t packets)
+{
+	int w;
+	uint32_t id;
+	struct snapshot *sn;
+	struct snaprow *r;
+
+	sn = snap_new(time, packets);
+	for (id = 0; id < nbackends; ++id) {
+		r = snap_add(sn, bcold[id].name);
+		r->sr_src = bhot[id].src;
+		r->sr_dst = bhot[id].dst;
+		r->sr_conns = bhot[id].conns;
+		r->sr_dns = backend_rcount(id);
+		for (w = 0; w < NWINDOWS; ++w) {
+			r->sr_wconns[w] = win_get(bcold[id].wconns, time, w);
+			r->sr_wdns[w] = win_get(bcold[id].wdns, time, w);
 		}
 	}
+	snap_add_clients(sn);
+	snap_publish(sn);
 }
 
 /*
@@ -313,21 +716,29 @@ read_nsname(const uint8_t *data, int *offset, int len, char *out, int olen)
 {
 	int r = *offset, w = 0;
 	uint8_t n;
-	while (r < len && w < olen - 1) {
+	while (1) {
+		/* Running off the end means the capture cut the name short. */
+		if (r >= len || w >= olen - 1)
+			return (1);
 		n = data[r++];
 		if (n == 0x00) {
 			break;
 
 		} else if ((n & NSM_MASK) == NSM_STRING) {
+			if (r + n > len || w + n + 1 >= olen)
+				return (1);
 			memcpy(out + w, data + r, n);
 			w += n; r += n;
 			out[w++] = '.';
 
 		} else if ((n & NSM_MASK) == NSM_PTR) {
-			uint16_t ptr = data[r++];
+			uint16_t ptr;
 			int recuroff;
+			if (r >= len)
+				return (1);
+			ptr = data[r++];
 			ptr = ptr | ((n & ~NSM_MASK) << 8);
-			if (ptr > r) {
+			if (ptr >= r - 2) {
 				return (1);
 			}
 			recuroff = ptr;
@@ -347,29 +758,242 @@ read_nsname(const uint8_t *data, int *offset, int len, char *out, int olen)
 	return (0);
 }
 
+/*
+ * Returns the address key for the data of an A or AAAA record.
+ */
+static uint32_t
+rr_addr(uint16_t rtype, const uint8_t *rdata, uint16_t rlen)
+{
+	uint32_t addr;
+
+	if (rtype == NST_AAAA && rlen == 16)
+		return (addr_from6(rdata, 1));
+	if (rtype != NST_A || rlen != 4)
+		return (ADDR_NONE);
+	memcpy(&addr, rdata, 4);
+	addr = ntohl(addr);
+	return (addr >= ADDR_V6BASE ? ADDR_NONE : addr);
+}
+
+/*
+ * Step over an nsName without decoding it. Returns 0 on success.
+ */
+static int
+skip_nsname(const uint8_t *data, int *offset, int len)
+{
+	int r = *offset;
+	uint8_t n;
+
+	while (r < len) {
+		n = data[r++];
+		if (n == 0x00) {
+			*offset = r;
+			return (0);
+		} else if ((n & NSM_MASK) == NSM_PTR) {
+			*offset = r + 1;
+			return (r < len ? 0 : 1);
+		} else if ((n & NSM_MASK) != NSM_STRING) {
+			return (1);
+		}
+		r += n;
+	}
+	return (1);
+}
+
+/*
+ * Count the address (A and AAAA) records among the "ac" answers starting at
+ * "off". Returns -1 if the packet ends first.
+ */
+static int
+count_addrs(const uint8_t *data, int off, int len, uint16_t ac)
+{
+	uint16_t rtype, rlen;
+	int n = 0;
+
+	while (ac-- > 0) {
+		if (skip_nsname(data, &off, len) || off + 10 > len)
+			return (-1);
+		memcpy(&rtype, data + off, 2);
+		rtype = ntohs(rtype);
+		memcpy(&rlen, data + off + 8, 2);
+		off += 10 + ntohs(rlen);
+		if (rtype == NST_A || rtype == NST_AAAA)
+			n++;
+	}
+	return (off <= len ? n : -1);
+}
+
+/*
+ * CNAMEs seen in the additional section of the response being parsed, for
+ * tracing address records back to the SRV target they belong to.
+ */
+#define	MAXCHAIN	4
+struct chainlink {
+	char target[256];
+	char head[256];
+};
+
+static const char *
+chain_head(const struct chainlink *chain, int nchain, const char *name,
+    uint32_t time)
+{
+	int i;
+
+	for (i = 0; i < nchain; ++i) {
+		if (strcmp(chain[i].target, name) == 0)
+			return (chain[i].head);
+	}
+	return (alias_head(name, time));
+}
+
+static uint32_t
+dslot_home(uint64_t key)
+{
+	return (dhash64(key >> 32, (key >> 16) & 0xffff, key & 0xffff) &
+	    (dindexsize - 1));
+}
+
+static void
+dindex_insert(uint64_t key, struct dnsreq *r)
+{
+	uint32_t i, mask = dindexsize - 1;
+
+	i = dslot_home(key);
+	while (dindex[i].req != NULL)
+		i = (i + 1) & mask;
+	dindex[i].key = key;
+	dindex[i].req = r;
+}
+
+static void
+dindex_grow(void)
+{
+	struct dslot *old = dindex;
+	uint32_t i, oldsize = dindexsize;
+
+	dindexsize = (oldsize == 0) ? 1024 : oldsize * 2;
+	dindex = calloc(dindexsize, sizeof (*dindex));
+	for (i = 0; i < oldsize; ++i) {
+		if (old[i].req != NULL)
+			dindex_insert(old[i].key, old[i].req);
+	}
+	free(old);
+}
+
+/*
+ * Take the request in slot "i" out of the index and off its client's list
+ * (without freeing it), and close up the gap by moving back any later entry
+ * in the same run that would no longer be reachable from its home slot.
+ */
+static void
+remove_dnsreq(uint32_t i)
+{
+	struct dnsreq *r = dindex[i].req;
+	struct client *c = r->client;
+	uint32_t j, k, mask = dindexsize - 1;
+
+	if (r->cprev == NULL)
+		c->c_oldest = r->cnext;
+	else
+		r->cprev->cnext = r->cnext;
+	if (r->cnext == NULL)
+		c->c_newest = r->cprev;
+	else
+		r->cnext->cprev = r->cprev;
+	c->c_nreqs--;
+	client_release_req(c, sizeof (*r));
+
+	dindex[i].req = NULL;
+	ndnsreqs--;
+	for (j = (i + 1) & mask; dindex[j].req != NULL; j = (j + 1) & mask) {
+		k = dslot_home(dindex[j].key);
+		if ((i < j) ? (k > i && k <= j) : (k > i || k <= j))
+			continue;
+		dindex[i] = dindex[j];
+		dindex[j].req = NULL;
+		i = j;
+	}
+}
+
+/*
+ * Drop a client's oldest outstanding request to make room for something
+ * newer. Returns -1 if it has none.
+ */
+int
+evict_dnsreq(struct client *c)
+{
+	struct dnsreq *r = c->c_oldest;
+	uint32_t i, mask = dindexsize - 1;
+
+	if (r == NULL)
+		return (-1);
+	i = dslot_home(DKEY(r->src, r->qid, r->sport));
+	while (dindex[i].req != r)
+		i = (i + 1) & mask;
+	remove_dnsreq(i);
+	free(r);
+	c->c_evicted++;
+	return (0);
+}
+
+/*
+ * Start tracking a request, charging it to its client. If the client is over
+ * quota, its oldest requests make way; if it has none, the request isn't
+ * tracked and we return -1.
+ */
+static int
+add_dnsreq(struct dnsreq *r)
+{
+	struct client *c = r->client;
+
+	if (client_charge_req(c, sizeof (*r)) != 0)
+		return (-1);
+	r->cprev = c->c_newest;
+	if (c->c_newest == NULL)
+		c->c_oldest = r;
+	else
+		c->c_newest->cnext = r;
+	c->c_newest = r;
+	c->c_nreqs++;
+
+	if ((ndnsreqs + 1) * 2 > dindexsize)
+		dindex_grow();
+	dindex_insert(DKEY(r->src, r->qid, r->sport), r);
+	ndnsreqs++;
+	return (0);
+}
+
+/*
+ * Returns non-zero if "client" has a tracked request outstanding from "port".
+ * Used to tell whether a DNS-over-TCP stream we lost part of mattered.
+ */
+int
+dns_pending(uint32_t client, uint16_t port)
+{
+	struct client *c;
+	struct dnsreq *r;
+
+	if ((c = client_find(client, 0)) == NULL)
+		return (0);
+	for (r = c->c_oldest; r != NULL; r = r->cnext) {
+		if (r->sport == port)
+			return (1);
+	}
+	return (0);
+}
+
 /* Clean out expired DNS requests. */
 void
 clean_dns(uint32_t time)
 {
-	int h;
-	struct dnsreq *pr, *nr, *r;
-
-	for (h = 0; h < BUCKETS; ++h) {
-		for (pr = NULL, r = dnsreqs[h]; r != NULL; pr = r, r = nr) {
-			nr = r->next;
-			if (time - r->ctime >= 10) {
-				if (pr == NULL) {
-					dnsreqs[h] = r->next;
-					free(r);
-					r = NULL;
-					nr = dnsreqs[h];
-				} else {
-					pr->next = r->next;
-					free(r);
-					r = NULL;
-					nr = pr->next;
-				}
-			} 
+	struct dnsreq *r;
+	uint32_t i;
+
+	for (i = 0; i < dindexsize; ++i) {
+		/* Removing may move a later entry into this slot. */
+		while ((r = dindex[i].req) != NULL && time - r->ctime >= 10) {
+			remove_dnsreq(i);
+			free(r);
 		}
 	}
 }
@@ -377,10 +1001,10 @@ clean_dns(uint32_t time)
 /* Parse a snooped DNS packet and index its contents. */
 void
 parse_dns(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
-    const uint8_t *data, int len, uint32_t time)
+    const uint8_t *data, int len, uint32_t time, uint32_t usec)
 {
-	uint16_t qid, qc, ac, nc, ec, tac;
-	int h, off = 0;
+	uint16_t qid, flags, qc, ac, nc, ec;
+	int off = 0;
 	enum nspos pos = NSP_QUESTION;
 
 	if (len < 12) {
@@ -395,19 +1019,15 @@ parse_dns(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
 	memcpy(&qid, data + off, 2);
 	qid = ntohs(qid);
 	off += 2;
-	off += 2; /* flags */
+	memcpy(&flags, data + off, 2);
+	flags = ntohs(flags);
+	off += 2;
 	memcpy(&qc, data + off, 2);
 	qc = ntohs(qc);
 	off += 2;
 	memcpy(&ac, data + off, 2);
 	ac = ntohs(ac);
-	tac = ac;
 	off += 2;
-	if (qc > 1 || ac > 1000) {
-		fprintf(stderr, "warning: weird looking dns packet "
-		    "says %d q, %d ans\n", qc, ac);
-		return;
-	}
 	memcpy(&nc, data + off, 2);
 	nc = ntohs(nc);
 	off += 2;
@@ -424,11 +1044,11 @@ parse_dns(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
 		uint16_t qtype, qclass;
 		r = calloc(sizeof (*r), 1);
 		r->qid = qid;
-		r->src = src;
-		r->dst = dst;
 		r->sport = sport;
 		r->ctime = time;
-		if (read_nsname(data, &off, len, r->name, 256)) {
+		r->cusec = usec;
+		if (read_nsname(data, &off, len, r->name, 256) ||
+		    off + 4 > len) {
 			free(r);
 			return;
 		}
@@ -438,7 +1058,8 @@ parse_dns(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
 		off += 2;
 		qtype = ntohs(qtype);
 		qclass = ntohs(qclass);
-		if (qclass != NSC_IN || (qtype != NST_A && qtype != NST_SRV)) {
+		if (qclass != NSC_IN || (qtype != NST_A &&
+		    qtype != NST_AAAA && qtype != NST_SRV)) {
 			free(r);
 			return;
 		}
@@ -446,51 +1067,119 @@ parse_dns(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
 			free(r);
 			return;
 		}
-		h = dhash(src, qid);
-		r->next = dnsreqs[h];
-		dnsreqs[h] = r;
+		/* We're tracking it, so its addresses need real keys. */
+		src = addr_resolve(src, 1);
+		dst = addr_resolve(dst, 1);
+		if (src == ADDR_NONE || dst == ADDR_NONE) {
+			free(r);
+			return;
+		}
+		r->src = src;
+		r->dst = dst;
+		r->qtype = qtype;
+		r->client = client_find(src, 1);
+		r->client->c_lookups++;
+		/* Before add_dnsreq(): making room may evict requests. */
+		if (ttlstats)
+			ttl_lookup(src, r->name, qtype, time);
+		if (add_dnsreq(r) != 0) {
+			free(r);
+			return;
+		}
 
 	/*
-	 * If it's incoming *from* the NS and has some answers in it, it could
-	 * also be interesting, but only if it matches up with an interesting
-	 * request we started tracking earlier.
+	 * If it's incoming *from* the NS, it could also be interesting, but
+	 * only if it matches up with an interesting request we started
+	 * tracking earlier.
 	 */
-	} else if (sport == 53 && ac != 0) {
-		struct dnsreq *r = NULL, *nr = NULL;
+	} else if (sport == 53) {
+		struct dnsreq *nr = NULL;
 		struct srvrec *srv = NULL;
+		struct chainlink chain[MAXCHAIN];
 		char name[256];
-		int didsrv = 0;
+		const char *head;
+		int didsrv = 0, naddrs, nchain = 0, gotname = 0, qoff = off;
+		uint32_t minttl = UINT32_MAX;
+		uint64_t key;
+		uint32_t i, mask = dindexsize - 1;
 
-		if (read_nsname(data, &off, len, name, 256)) {
+		/*
+		 * Find a matching tracked DNS request before looking at
+		 * anything past the header: most responses on a busy
+		 * resolver are to queries we aren't tracking.
+		 */
+		if (dindexsize == 0)
 			return;
-		}
-		off += 4; /* type, qclass */
-
-		/* Find a matching tracked DNS request. */
-		h = dhash(dst, qid);
-		for (nr = dnsreqs[h]; nr != NULL; r = nr, nr = r->next) {
-			if (nr->qid == qid && nr->dst == src &&
-			    nr->src == dst && nr->sport == dport &&
-			    strcmp(name, nr->name) == 0) {
+		src = addr_resolve(src, 0);
+		dst = addr_resolve(dst, 0);
+		if (src == ADDR_NONE || dst == ADDR_NONE)
+			return;
+		key = DKEY(dst, qid, dport);
+		for (i = dslot_home(key); dindex[i].req != NULL;
+		    i = (i + 1) & mask) {
+			if (dindex[i].key != key || dindex[i].req->dst != src)
+				continue;
+			if (!gotname) {
+				if (qc > 1 || ac > 1000) {
+					fprintf(stderr, "warning: weird "
+					    "looking dns packet says %d q, "
+					    "%d ans\n", qc, ac);
+					return;
+				}
+				if (read_nsname(data, &qoff, len, name, 256))
+					return;
+				gotname = 1;
+			}
+			if (strcmp(name, dindex[i].req->name) == 0) {
+				nr = dindex[i].req;
 				break;
 			}
 		}
 		if (nr == NULL) {
 			return;
 		}
+		off = qoff + 4; /* type, qclass */
+
+		/* Take it out of the index; we free it when we're done. */
+		remove_dnsreq(i);
+		client_answer(nr->client, nr->ctime, nr->cusec, time, usec);
+		if (ac == 0) {
+			free(nr);
+			return;
+		}
 
-		/* Unlink it from the list. */
-		if (r == NULL)
-			dnsreqs[h] = nr->next;
-		else
-			r->next = nr->next;
+		/*
+		 * A truncated response will be retried over TCP, and we'll
+		 * count the full answer set from that. Don't count the
+		 * partial one as well.
+		 */
+		if (flags & NSF_TC) {
+			free(nr);
+			return;
+		}
 
+		/*
+		 * Count the addresses in the answer first: a name with only
+		 * one backend isn't interesting. (We count them rather than
+		 * the answers, as there may be CNAMEs in among them.)
+		 */
+		naddrs = count_addrs(data, off, len, ac);
+		if (naddrs == -1) {
+			loss_dns_cut();
+			free(nr);
+			return;
+		}
+
+		/* The name looked up may be an SRV target behind a CNAME. */
 		srv = find_srv_target(name);
+		if (srv == NULL && (head = alias_head(name, time)) != NULL)
+			srv = find_srv_target(head);
 		pos = NSP_ANSWER;
 
 		/* Parse all the answers and additional records */
 		while (off < len) {
 			uint16_t rtype, rclass, rlen;
+			uint32_t rttl;
 
 			if (pos == NSP_ANSWER && ac <= 0)
 				pos = NSP_AUTHORITY;
@@ -499,7 +1188,9 @@ parse_dns(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
 			if (pos == NSP_ADDITIONAL && ec <= 0)
 				break;
 
-			if (read_nsname(data, &off, len, name, 256)) {
+			if (read_nsname(data, &off, len, name, 256) ||
+			    off + 10 > len) {
+				loss_dns_cut();
 				free(nr);
 				return;
 			}
@@ -509,10 +1200,17 @@ parse_dns(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
 			memcpy(&rclass, data + off, 2);
 			rclass = ntohs(rclass);
 			off += 2;
-			off += 4; /* rttl */
+			memcpy(&rttl, data + off, 4);
+			rttl = ntohl(rttl);
+			off += 4;
 			memcpy(&rlen, data + off, 2);
 			rlen = ntohs(rlen);
 			off += 2;
+			if (off + rlen > len) {
+				loss_dns_cut();
+				free(nr);
+				return;
+			}
 
 			if (rtype == NST_OPT)
 				goto next;
@@ -521,43 +1219,79 @@ parse_dns(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
 				free(nr);
 				return;
 			}
+			if (pos == NSP_ANSWER && rttl < minttl)
+				minttl = rttl;
+			if (pos == NSP_AUTHORITY)
+				goto next;
+
 			/*
 			 * For non-answers, use the name in the record itself
-			 * to decide if this is an SRV target.
+			 * (or the one it's an alias of) to decide if this is
+			 * an SRV target. Everything in the answer section is
+			 * for the name the client looked up, however long the
+			 * CNAME chain to get there.
 			 */
 			if (pos != NSP_ANSWER) {
 				srv = find_srv_target(name);
+				if (srv == NULL && (head = chain_head(chain,
+				    nchain, name, time)) != NULL)
+					srv = find_srv_target(head);
 			}
 
-			if (pos == NSP_AUTHORITY)
-				goto next;
-
-			if (rtype == NST_CNAME && tac <= 2 && srv == NULL) {
-				free(nr);
-				return;
-			}
+			if (rtype == NST_CNAME) {
+				char target[256];
+				int inoff = off;
+				if (read_nsname(data, &inoff, len, target,
+				    sizeof (target))) {
+					free(nr);
+					return;
+				}
+				if (pos == NSP_ANSWER) {
+					head = nr->name;
+				} else {
+					head = chain_head(chain, nchain, name,
+					    time);
+					if (head == NULL)
+						head = name;
+				}
+				if (pos != NSP_ANSWER && nchain < MAXCHAIN) {
+					strlcpy(chain[nchain].target, target,
+					    sizeof (chain[nchain].target));
+					strlcpy(chain[nchain].head, head,
+					    sizeof (chain[nchain].head));
+					head = chain[nchain++].head;
+				}
+				alias_add(nr->client, target, head, time,
+				    rttl);
 
-			if (rtype == NST_A && (
-			    (pos == NSP_ANSWER && tac > 1) || srv != NULL)) {
-				uint32_t addr;
-				memcpy(&addr, data + off, 4);
-				addr = ntohl(addr);
-				make_backend(dst, addr, name, srv);
+			} else if ((rtype == NST_A || rtype == NST_AAAA) && (
+			    (pos == NSP_ANSWER && naddrs > 1) || srv != NULL)) {
+				uint32_t addr = rr_addr(rtype, data + off, rlen);
+				if (addr != ADDR_NONE) {
+					make_backend(dst, addr,
+					    (pos == NSP_ANSWER) ? nr->name :
+					    name, srv, time);
+				}
 
 			} else if (rtype == NST_SRV) {
 				uint16_t port;
 				char target[256];
 				int inoff = off;
+				/* Priority, weight, port and at least a root. */
+				if (rlen < 7)
+					goto next;
 				inoff += 4; /* priority, weight */
 				memcpy(&port, data + inoff, 2);
 				port = ntohs(port);
 				inoff += 2;
-				if (read_nsname(data, &inoff, len, target,
+				/* The target must end within the rdata. */
+				if (read_nsname(data, &inoff, off + rlen, target,
 				    sizeof (target))) {
 					free(nr);
 					return;
 				}
-				saw_srv_target(target, port, name);
+				saw_srv_target(nr->client, target, port,
+				    (pos == NSP_ANSWER) ? nr->name : name);
 				didsrv = 1;
 			}
 
@@ -570,7 +1304,13 @@ next:
 			else if (pos == NSP_ADDITIONAL)
 				--ec;
 		}
-		
+
+		/* We ran out of packet before we ran out of records. */
+		if (ac > 0 || nc > 0 || ec > 0)
+			loss_dns_cut();
+
+		if (ttlstats && minttl != UINT32_MAX)
+			ttl_answer(dst, nr->name, nr->qtype, time, minttl);
 		free(nr);
 	}
 }
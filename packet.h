@@ -9,12 +9,49 @@
 #if !defined(_PACKET_H)
 #define _PACKET_H
 
+#include <stdio.h>
+#include <stdint.h>
+
+struct service;
+struct srvrec;
+struct client;
+
 void clean_dns(uint32_t time);
-void got_tcp_syn(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport);
-void got_tcp(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport);
+int evict_dnsreq(struct client *c);
+void make_backend(uint32_t src, uint32_t dst, const char *name,
+    struct srvrec *srv, uint32_t time);
+uint64_t backend_conns(uint32_t id);
+void got_tcp_syn(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    uint32_t time);
+void got_tcp(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    uint32_t time);
+void got_tcp_retry(uint32_t src, uint32_t dst, uint16_t dport);
+int syn_retransmit(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    uint32_t seq, uint32_t time);
 void got_tcp_fin(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport);
-void print_summary(void);
+void print_summary(FILE *out, uint32_t client);
+void tally_clients(void);
+void snapshot_backends(uint32_t time, uint64_t packets);
 void parse_dns(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
-    const uint8_t *data, int len, uint32_t time);
+    const uint8_t *data, int len, uint32_t time, uint32_t usec);
+int dns_pending(uint32_t client, uint16_t port);
+void clean_dns_tcp(uint32_t time);
+void got_dns_tcp(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    uint32_t seq, uint8_t flags, const uint8_t *data, int len, int trunc,
+    uint32_t time, uint32_t usec);
+void ttl_lookup(uint32_t src, const char *name, uint16_t qtype, uint32_t time);
+void ttl_answer(uint32_t src, const char *name, uint16_t qtype, uint32_t time,
+    uint32_t ttl);
+void print_ttl_summary(FILE *out, uint32_t client);
+void alias_add(struct client *c, const char *target, const char *head,
+    uint32_t time, uint32_t ttl);
+const char *alias_head(const char *target, uint32_t time);
+void clean_aliases(uint32_t time);
+struct service *svc_find(uint32_t src, const char *name);
+int svc_add_backend(struct service *s, uint32_t id, uint64_t r);
+void svc_other_family(struct service *s);
+void svc_conn(struct service *s, uint64_t c, uint64_t r);
+void svc_returned(struct service *s, uint64_t c, uint64_t oldr, uint64_t newr);
+void print_balance_summary(FILE *out, uint32_t client);
 
 #endif
@@ -0,0 +1,385 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * Read-ahead thread for the capture input (-r).
+ *
+ * A separate thread does all the read(2) calls into a small ring of large
+ * buffers, so that snoop never blocks on a full pipe while we're busy
+ * parsing. Buffers are handed between the two threads with a pair of
+ * counters (single producer, single consumer, no locks): the reader owns
+ * buffers [head, tail + RA_NBUF) and the parser owns [tail, head). The
+ * buffer the reader is filling is shared as well: the reader publishes its
+ * length after every read(), so the parser can start on the data at once,
+ * and only moves head on when the buffer is full.
+ *
+ * The parser frames records in place, straight out of the buffers. A record
+ * that runs off the end of one buffer is completed by copying its start into
+ * the lead-in kept in front of the next, or into a separate stitch buffer if
+ * it's too big for that.
+ */
+
+#if defined(__linux__)
+#define	_GNU_SOURCE		/* for F_SETPIPE_SZ */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "readahead.h"
+
+#define	RA_NBUF		3
+#define	RA_BUFSZ	(4 * 1024 * 1024)
+#define	RA_LEAD		(256 * 1024)	/* room in front for a record's start */
+#define	RA_PIPESZ	(1024 * 1024)
+
+extern int gotint;
+extern int gottick;
+
+struct rabuf {
+	uint8_t *rb_mem;		/* RA_LEAD + RA_BUFSZ */
+	uint8_t *rb_data;		/* rb_mem + RA_LEAD */
+	atomic_size_t rb_len;		/* bytes read into rb_data so far */
+};
+
+struct readahead {
+	int ra_fd;
+	pthread_t ra_thread;
+	struct rabuf ra_bufs[RA_NBUF];
+	atomic_uint ra_head;		/* # of buffers filled by the reader */
+	atomic_uint ra_tail;		/* # of buffers drained by the parser */
+	atomic_int ra_done;		/* reader hit EOF (1) or an error (-1) */
+	size_t ra_off;			/* parser's offset into buffer at tail */
+	size_t ra_lead;			/* bytes of its lead-in in use */
+	uint8_t *ra_stitch;		/* for records too big for a lead-in */
+	size_t ra_stitchsize;
+	_Atomic uint64_t ra_fullstalls;	/* reader waited for a free buffer */
+	_Atomic uint64_t ra_emptystalls; /* parser waited for a full buffer */
+};
+
+/* What ra_next() found at the tail. */
+#define	RA_DATA		0		/* data past ra_off */
+#define	RA_DRAINED	1		/* the buffer is full and all used */
+#define	RA_EOF		2
+#define	RA_ERROR	(-1)		/* or we were interrupted */
+
+/*
+ * Wait a little while for the other side. We spin briefly first, since
+ * handoffs are usually quick, then back off to sleeping.
+ */
+static void
+ra_wait(int *spins)
+{
+	struct timespec ts = { 0, 50000 };
+
+	if (++(*spins) < 1000)
+		return;
+	(void) nanosleep(&ts, NULL);
+}
+
+static void *
+ra_thread(void *arg)
+{
+	struct readahead *ra = arg;
+	struct rabuf *rb;
+	unsigned int head = 0;
+	size_t len;
+	ssize_t n;
+	int done = 0, spins;
+
+	while (done == 0) {
+		if (head - atomic_load_explicit(&ra->ra_tail,
+		    memory_order_acquire) == RA_NBUF) {
+			atomic_fetch_add_explicit(&ra->ra_fullstalls, 1,
+			    memory_order_relaxed);
+			spins = 0;
+			while (head - atomic_load_explicit(&ra->ra_tail,
+			    memory_order_acquire) == RA_NBUF)
+				ra_wait(&spins);
+		}
+
+		/*
+		 * Publish what we have after every read, so the parser
+		 * never waits on us while we wait on the input.
+		 */
+		rb = &ra->ra_bufs[head % RA_NBUF];
+		len = 0;
+		while (len < RA_BUFSZ) {
+			n = read(ra->ra_fd, rb->rb_data + len, RA_BUFSZ - len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				done = (n == 0) ? 1 : -1;
+				break;
+			}
+			len += n;
+			atomic_store_explicit(&rb->rb_len, len,
+			    memory_order_release);
+		}
+
+		if (len > 0) {
+			++head;
+			atomic_store_explicit(&ra->ra_head, head,
+			    memory_order_release);
+		}
+	}
+	atomic_store_explicit(&ra->ra_done, done, memory_order_release);
+	return (NULL);
+}
+
+/*
+ * Start a read-ahead thread on "fd". If it's a pipe and the platform lets
+ * us, enlarge the pipe too, so snoop has more room while we catch up.
+ */
+struct readahead *
+readahead_start(int fd)
+{
+	struct readahead *ra;
+	sigset_t set, oset;
+	int i;
+
+#if defined(F_SETPIPE_SZ)
+	(void) fcntl(fd, F_SETPIPE_SZ, RA_PIPESZ);
+#endif
+
+	ra = calloc(sizeof (*ra), 1);
+	ra->ra_fd = fd;
+	for (i = 0; i < RA_NBUF; ++i) {
+		ra->ra_bufs[i].rb_mem = malloc(RA_LEAD + RA_BUFSZ);
+		ra->ra_bufs[i].rb_data = ra->ra_bufs[i].rb_mem + RA_LEAD;
+		atomic_init(&ra->ra_bufs[i].rb_len, 0);
+	}
+	atomic_init(&ra->ra_head, 0);
+	atomic_init(&ra->ra_tail, 0);
+	atomic_init(&ra->ra_done, 0);
+	atomic_init(&ra->ra_fullstalls, 0);
+	atomic_init(&ra->ra_emptystalls, 0);
+
+	/* Leave SIGINT, and the daemon's ticks, to the main thread. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	if (pthread_create(&ra->ra_thread, NULL, ra_thread, ra) != 0) {
+		perror("pthread_create");
+		exit(2);
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	return (ra);
+}
+
+/*
+ * Wait for the buffer at the tail to have data past ra_off, or to be full
+ * and used up, and return which (RA_DATA or RA_DRAINED, with its length in
+ * "*lenp"), or RA_EOF or RA_ERROR.
+ */
+static int
+ra_next(struct readahead *ra, size_t *lenp)
+{
+	struct rabuf *rb;
+	unsigned int tail;
+	size_t len;
+	int done, spins = 0;
+
+	tail = atomic_load_explicit(&ra->ra_tail, memory_order_relaxed);
+	rb = &ra->ra_bufs[tail % RA_NBUF];
+	for (;;) {
+		/*
+		 * The reader's last length store comes before it moves head
+		 * on, and both before ra_done, so check in that order.
+		 */
+		done = atomic_load_explicit(&ra->ra_done,
+		    memory_order_acquire);
+		*lenp = atomic_load_explicit(&rb->rb_len,
+		    memory_order_acquire);
+		if (*lenp > ra->ra_off)
+			return (RA_DATA);
+		if (atomic_load_explicit(&ra->ra_head,
+		    memory_order_acquire) != tail) {
+			/* Head moved on, so the length we read may be old. */
+			len = atomic_load_explicit(&rb->rb_len,
+			    memory_order_acquire);
+			*lenp = len;
+			return (len > ra->ra_off ? RA_DATA : RA_DRAINED);
+		}
+		if (done != 0)
+			return (done > 0 ? RA_EOF : RA_ERROR);
+		if (gotint || gottick)
+			return (RA_ERROR);
+		if (spins == 0) {
+			atomic_fetch_add_explicit(&ra->ra_emptystalls, 1,
+			    memory_order_relaxed);
+		}
+		ra_wait(&spins);
+	}
+}
+
+/* Give the drained buffer at the tail back to the reader. */
+static void
+ra_release(struct readahead *ra)
+{
+	unsigned int tail;
+
+	tail = atomic_load_explicit(&ra->ra_tail, memory_order_relaxed);
+	atomic_store_explicit(&ra->ra_bufs[tail % RA_NBUF].rb_len, 0,
+	    memory_order_relaxed);
+	ra->ra_off = 0;
+	ra->ra_lead = 0;
+	atomic_store_explicit(&ra->ra_tail, tail + 1, memory_order_release);
+}
+
+/*
+ * Copy up to "len" bytes of already read-ahead input into "buf". Only waits
+ * if the reader has nothing buffered at all. This is for the decompressor,
+ * which needs its own copy; uncompressed input uses readahead_view().
+ *
+ * Returns the number of bytes copied, 0 at end of input or -1 on error (or
+ * if we were interrupted or the daemon's timer ticked while waiting).
+ */
+ssize_t
+readahead_read(struct readahead *ra, uint8_t *buf, size_t len)
+{
+	struct rabuf *rb;
+	size_t avail, n;
+	int r;
+
+	while ((r = ra_next(ra, &avail)) == RA_DRAINED)
+		ra_release(ra);
+	if (r != RA_DATA)
+		return (r == RA_EOF ? 0 : -1);
+
+	rb = &ra->ra_bufs[atomic_load_explicit(&ra->ra_tail,
+	    memory_order_relaxed) % RA_NBUF];
+	n = avail - ra->ra_off;
+	if (n > len)
+		n = len;
+	memcpy(buf, rb->rb_data + ra->ra_off, n);
+	ra->ra_off += n;
+	return (n);
+}
+
+/*
+ * Move the "left" bytes at "lp" (which may be in the stitch buffer already)
+ * to the front of the stitch buffer, with room for "more" after them.
+ */
+static uint8_t *
+ra_to_stitch(struct readahead *ra, const uint8_t *lp, size_t left,
+    size_t more)
+{
+	size_t nsize;
+	int inside;
+
+	inside = (ra->ra_stitch != NULL && lp >= ra->ra_stitch &&
+	    lp < ra->ra_stitch + ra->ra_stitchsize);
+	if (inside)
+		memmove(ra->ra_stitch, lp, left);
+	if (left + more > ra->ra_stitchsize) {
+		for (nsize = RA_LEAD; nsize < left + more; nsize *= 2)
+			;
+		ra->ra_stitch = realloc(ra->ra_stitch, nsize);
+		if (ra->ra_stitch == NULL) {
+			perror("realloc");
+			exit(2);
+		}
+		ra->ra_stitchsize = nsize;
+	}
+	if (!inside)
+		memcpy(ra->ra_stitch, lp, left);
+	return (ra->ra_stitch);
+}
+
+/*
+ * Extend the caller's view of the input in place. On entry, (*bufp)[*offp]
+ * up to (*bufp)[*lenp] is what it has left unconsumed of the view we last
+ * gave it (or of what it copied with readahead_read()); on return, the view
+ * is that followed directly by more input, and may have moved. Pointers into
+ * the old view are no good afterwards.
+ *
+ * Returns the number of bytes added, 0 at end of input or -1 on error (or
+ * as readahead_read()).
+ */
+ssize_t
+readahead_view(struct readahead *ra, uint8_t **bufp, size_t *offp,
+    size_t *lenp)
+{
+	struct rabuf *rb, *next;
+	size_t left = *lenp - *offp, avail, n;
+	uint8_t *lp = *bufp + *offp;
+	unsigned int tail;
+	int r;
+
+	for (;;) {
+		r = ra_next(ra, &avail);
+		if (r == RA_EOF)
+			return (0);
+		if (r == RA_ERROR)
+			return (-1);
+
+		tail = atomic_load_explicit(&ra->ra_tail,
+		    memory_order_relaxed);
+		rb = &ra->ra_bufs[tail % RA_NBUF];
+		if (r == RA_DATA)
+			break;
+
+		/*
+		 * This buffer is used up, so carry what's left of it over
+		 * to the front of the next, before giving it back.
+		 */
+		next = &ra->ra_bufs[(tail + 1) % RA_NBUF];
+		if (left <= RA_LEAD) {
+			memcpy(next->rb_data - left, lp, left);
+			lp = next->rb_data - left;
+		} else {
+			lp = ra_to_stitch(ra, lp, left, 0);
+		}
+		ra_release(ra);
+		if (left <= RA_LEAD)
+			ra->ra_lead = left;
+		/* The old view is gone, even if we can't go on yet. */
+		*bufp = lp;
+		*offp = 0;
+		*lenp = left;
+	}
+
+	/*
+	 * If what's left is all in this buffer (or its lead-in), which it
+	 * nearly always is, the new data follows it already. If not, it's
+	 * a big record that started more than a lead-in back, and we put
+	 * the two together in the stitch buffer.
+	 */
+	n = avail - ra->ra_off;
+	if (left <= ra->ra_off + ra->ra_lead) {
+		*bufp = rb->rb_data + ra->ra_off - left;
+	} else {
+		*bufp = ra_to_stitch(ra, lp, left, n);
+		memcpy(*bufp + left, rb->rb_data + ra->ra_off, n);
+	}
+	*offp = 0;
+	*lenp = left + n;
+	ra->ra_off = avail;
+	return (n);
+}
+
+void
+readahead_stats(struct readahead *ra, uint64_t *fullstalls,
+    uint64_t *emptystalls)
+{
+	/* The reader may still be running if we were interrupted. */
+	*fullstalls = atomic_load(&ra->ra_fullstalls);
+	*emptystalls = atomic_load(&ra->ra_emptystalls);
+}
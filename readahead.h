@@ -0,0 +1,25 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+#if !defined(_READAHEAD_H)
+#define _READAHEAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct readahead;
+
+struct readahead *readahead_start(int fd);
+ssize_t readahead_read(struct readahead *ra, uint8_t *buf, size_t len);
+ssize_t readahead_view(struct readahead *ra, uint8_t **bufp, size_t *offp,
+    size_t *lenp);
+void readahead_stats(struct readahead *ra, uint64_t *fullstalls,
+    uint64_t *emptystalls);
+
+#endif
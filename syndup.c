@@ -0,0 +1,94 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * SYN retransmission detection. A client that gets no answer to its SYN
+ * sends it again (after 1s, 3s, 7s, ...) with the same ports and the same
+ * initial sequence number, so a SYN whose 4-tuple and ISN we saw recently is
+ * a retry of the same connection attempt, not a new one.
+ *
+ * We remember fingerprints of recent SYNs in SYNDUP_NGEN generations of
+ * fixed-size tables, each covering SYNDUP_GENSECS of capture time. When a
+ * generation's time comes around again it is simply cleared, so memory is
+ * bounded and expiry costs nothing per SYN. If all the slots a SYN could go
+ * in are taken, the first is overwritten; under that much load we may miss
+ * some retries, but never count a new connection as one (bar a fingerprint
+ * collision).
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+#include "packet.h"
+
+#define	SYNDUP_NGEN	4
+#define	SYNDUP_GENSECS	8		/* so retries within 24-32s */
+#define	SYNDUP_SLOTS	65536		/* per generation, a power of 2 */
+#define	SYNDUP_PROBES	8
+
+struct syngen {
+	uint32_t sg_epoch;		/* time / SYNDUP_GENSECS + 1, 0 unused */
+	uint32_t sg_fp[SYNDUP_SLOTS];	/* 0 is an empty slot */
+};
+
+static struct syngen syngens[SYNDUP_NGEN];
+
+static int
+syngen_find(const struct syngen *g, uint32_t slot, uint32_t fp)
+{
+	int i;
+
+	for (i = 0; i < SYNDUP_PROBES; ++i) {
+		uint32_t v = g->sg_fp[(slot + i) & (SYNDUP_SLOTS - 1)];
+		if (v == fp)
+			return (1);
+		if (v == 0)
+			return (0);
+	}
+	return (0);
+}
+
+/*
+ * Returns 1 if this SYN is a retransmission of one seen in the last
+ * SYNDUP_NGEN - 1 generations, and otherwise remembers it and returns 0.
+ */
+int
+syn_retransmit(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    uint32_t seq, uint32_t time)
+{
+	uint64_t h = synhash(src, dst, sport, dport, seq);
+	uint32_t slot = h & (SYNDUP_SLOTS - 1);
+	uint32_t fp = (h >> 32) | 1;
+	uint32_t epoch = time / SYNDUP_GENSECS + 1;
+	struct syngen *g;
+	int i;
+
+	for (i = 0; i < SYNDUP_NGEN; ++i) {
+		g = &syngens[i];
+		if (g->sg_epoch == 0 || epoch - g->sg_epoch >= SYNDUP_NGEN)
+			continue;
+		if (syngen_find(g, slot, fp))
+			return (1);
+	}
+
+	g = &syngens[epoch % SYNDUP_NGEN];
+	if (g->sg_epoch != epoch) {
+		memset(g->sg_fp, 0, sizeof (g->sg_fp));
+		g->sg_epoch = epoch;
+	}
+	for (i = 0; i < SYNDUP_PROBES; ++i) {
+		uint32_t *v = &g->sg_fp[(slot + i) & (SYNDUP_SLOTS - 1)];
+		if (*v == 0) {
+			*v = fp;
+			return (0);
+		}
+	}
+	g->sg_fp[slot] = fp;
+	return (0);
+}
@@ -0,0 +1,172 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * TTL compliance tracking (-t): for each (client, name, query type) we
+ * remember when the client last got an answer and its TTL, and count the
+ * lookups it makes while that answer should still have been cached. The type
+ * is part of the key so that a dual-stack client's AAAA lookup right after
+ * its A lookup doesn't count as an early requery.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "enums.h"
+#include "addr.h"
+#include "hash.h"
+#include "packet.h"
+#include "client.h"
+
+struct ttlrec {
+	struct ttlrec *next;
+	struct ttlrec *cnext;		/* the client's next record */
+	uint32_t src;			/* client IP */
+	uint16_t qtype;			/* NST_A, NST_AAAA or NST_SRV */
+	uint32_t atime;			/* hdr.sec of last answer, 0 if none */
+	uint32_t ttl;			/* lowest TTL in the last answer */
+	uint32_t lookups;
+	uint32_t early;			/* lookups before atime + ttl */
+	uint32_t requeries;		/* lookups made after some answer */
+	uint64_t intsum;		/* sum of (lookup time - atime) */
+	uint64_t ttlsum;		/* sum of ttl at each requery */
+	char name[256];
+};
+/*
+ * Per-(client, name, type) TTL records, hashed on src,name.
+ */
+struct ttlrec *ttlrecs[BUCKETS] = { NULL };
+
+static struct ttlrec *
+find_ttlrec(uint32_t src, const char *name, uint16_t qtype, int create)
+{
+	int h;
+	struct ttlrec *t;
+	struct client *c;
+
+	h = nhash(src, name);
+	for (t = ttlrecs[h]; t != NULL; t = t->next) {
+		if (t->src == src && t->qtype == qtype &&
+		    strcmp(t->name, name) == 0)
+			return (t);
+	}
+	if (!create)
+		return (NULL);
+
+	c = client_find(src, 1);
+	if (client_charge(c, sizeof (*t)) != 0)
+		return (NULL);
+	t = calloc(sizeof (*t), 1);
+	t->src = src;
+	t->qtype = qtype;
+	strlcpy(t->name, name, sizeof (t->name));
+	t->next = ttlrecs[h];
+	ttlrecs[h] = t;
+	t->cnext = c->c_ttlrecs;
+	c->c_ttlrecs = t;
+	return (t);
+}
+
+/*
+ * Called from parse_dns() when a client sends a query for a name we track.
+ */
+void
+ttl_lookup(uint32_t src, const char *name, uint16_t qtype, uint32_t time)
+{
+	struct ttlrec *t;
+
+	/* This can fail if the client is over its quota. */
+	if ((t = find_ttlrec(src, name, qtype, 1)) == NULL)
+		return;
+	t->lookups++;
+	if (t->atime == 0)
+		return;
+	t->requeries++;
+	t->intsum += time - t->atime;
+	t->ttlsum += t->ttl;
+	if (time - t->atime < t->ttl)
+		t->early++;
+}
+
+/*
+ * Called from parse_dns() when a tracked query gets its answer. "ttl" is the
+ * lowest TTL of the records in the answer section.
+ */
+void
+ttl_answer(uint32_t src, const char *name, uint16_t qtype, uint32_t time,
+    uint32_t ttl)
+{
+	struct ttlrec *t;
+
+	t = find_ttlrec(src, name, qtype, 0);
+	if (t == NULL)
+		return;
+	t->atime = time;
+	t->ttl = ttl;
+}
+
+static const char *
+qtype_name(uint16_t qtype)
+{
+	switch (qtype) {
+	case NST_A:
+		return ("A");
+	case NST_AAAA:
+		return ("AAAA");
+	case NST_SRV:
+		return ("SRV");
+	default:
+		return ("?");
+	}
+}
+
+/*
+ * Print one line per client, name and type (or only for "client", unless it's
+ * ADDR_NONE).
+ */
+static void
+print_ttlrec(FILE *out, const struct ttlrec *t)
+{
+	char srcs[ADDR_STRLEN];
+
+	addr_fmt(t->src, srcs);
+	if (t->requeries == 0) {
+		fprintf(out, "%s\t%u\t0\t0\t-\t-\t-\t%s\t%s\n",
+		    srcs, t->lookups, qtype_name(t->qtype), t->name);
+		return;
+	}
+	fprintf(out, "%s\t%u\t%u\t%u\t%.1f\t%.1f\t%.1f\t%s\t%s\n",
+	    srcs, t->lookups, t->requeries, t->early,
+	    100.0 * t->early / t->requeries,
+	    (double)t->intsum / t->requeries,
+	    (double)t->ttlsum / t->requeries, qtype_name(t->qtype), t->name);
+}
+
+void
+print_ttl_summary(FILE *out, uint32_t client)
+{
+	int h;
+	struct ttlrec *t;
+	struct client *c;
+
+	fprintf(out, "# client\tlookups\trequeries\tearly\t%%early\t"
+	    "avg interval\tavg ttl\ttype\tdns name\n");
+	if (client != ADDR_NONE) {
+		if ((c = client_find(client, 0)) == NULL)
+			return;
+		for (t = c->c_ttlrecs; t != NULL; t = t->cnext)
+			print_ttlrec(out, t);
+		return;
+	}
+	for (h = 0; h < BUCKETS; ++h) {
+		for (t = ttlrecs[h]; t != NULL; t = t->next)
+			print_ttlrec(out, t);
+	}
+}
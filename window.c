@@ -0,0 +1,105 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+/*
+ * Sliding-window counters for daemon mode (-D).
+ *
+ * There is no global tick: each counter catches itself up to the current
+ * time when it's next added to, zeroing the buckets that have expired since.
+ * Reading one just leaves those buckets out of the sum, without changing the
+ * counter, so a snapshot can look ahead of the capture while it's idle. Both
+ * are at most one ring's worth of work, so moving the windows on costs O(1)
+ * however many counters there are. Windows are accurate to one bucket (10s,
+ * 1m and 10m respectively).
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "window.h"
+
+static const struct winspec {
+	uint32_t ws_secs;		/* seconds per bucket */
+	uint32_t ws_nbuckets;
+	uint32_t ws_first;		/* index into wc_buckets */
+} winspecs[NWINDOWS] = {
+	{ 10, 6, 0 },			/* WIN_1M */
+	{ 60, 10, 6 },			/* WIN_10M */
+	{ 600, 6, 16 }			/* WIN_1H */
+};
+
+const char *win_names[NWINDOWS] = { "1m", "10m", "1h" };
+
+int
+win_parse(const char *name)
+{
+	int w;
+
+	for (w = 0; w < NWINDOWS; ++w) {
+		if (strcmp(name, win_names[w]) == 0)
+			return (w);
+	}
+	return (-1);
+}
+
+/* Move window "w" on to "time", expiring old buckets. */
+static uint32_t *
+win_advance(struct wincount *wc, uint32_t time, int w)
+{
+	const struct winspec *ws = &winspecs[w];
+	uint32_t *b = &wc->wc_buckets[ws->ws_first];
+	uint32_t now = time / ws->ws_secs;
+	uint32_t i, n;
+
+	if (now != wc->wc_epoch[w]) {
+		n = now - wc->wc_epoch[w];
+		if (n >= ws->ws_nbuckets || now < wc->wc_epoch[w]) {
+			memset(b, 0, ws->ws_nbuckets * sizeof (*b));
+			wc->wc_sum[w] = 0;
+		} else {
+			for (i = 1; i <= n; ++i) {
+				uint32_t *e = &b[(wc->wc_epoch[w] + i) %
+				    ws->ws_nbuckets];
+				wc->wc_sum[w] -= *e;
+				*e = 0;
+			}
+		}
+		wc->wc_epoch[w] = now;
+	}
+	return (&b[now % ws->ws_nbuckets]);
+}
+
+void
+win_add(struct wincount *wc, uint32_t time, uint32_t n)
+{
+	int w;
+
+	for (w = 0; w < NWINDOWS; ++w) {
+		*win_advance(wc, time, w) += n;
+		wc->wc_sum[w] += n;
+	}
+}
+
+uint32_t
+win_get(const struct wincount *wc, uint32_t time, int w)
+{
+	const struct winspec *ws = &winspecs[w];
+	const uint32_t *b = &wc->wc_buckets[ws->ws_first];
+	uint32_t now = time / ws->ws_secs;
+	uint32_t i, n, sum = wc->wc_sum[w];
+
+	/* An earlier time than the counter's is as good as its own. */
+	if (now <= wc->wc_epoch[w])
+		return (sum);
+	n = now - wc->wc_epoch[w];
+	if (n >= ws->ws_nbuckets)
+		return (0);
+	for (i = 1; i <= n; ++i)
+		sum -= b[(wc->wc_epoch[w] + i) % ws->ws_nbuckets];
+	return (sum);
+}
@@ -0,0 +1,40 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2016, Joyent, Inc.
+ */
+
+#if !defined(_WINDOW_H)
+#define _WINDOW_H
+
+#include <stdint.h>
+
+enum window {
+	WIN_1M = 0,
+	WIN_10M,
+	WIN_1H,
+	NWINDOWS
+};
+
+/* Total buckets across all windows (see winspecs in window.c). */
+#define	WIN_NBUCKETS	22
+
+/*
+ * A counter over sliding windows of the last minute, 10 minutes and hour.
+ * Each window is a ring of buckets plus a running sum.
+ */
+struct wincount {
+	uint32_t wc_epoch[NWINDOWS];	/* bucket number of newest bucket */
+	uint32_t wc_sum[NWINDOWS];
+	uint32_t wc_buckets[WIN_NBUCKETS];
+};
+
+extern const char *win_names[NWINDOWS];
+
+int win_parse(const char *name);
+void win_add(struct wincount *wc, uint32_t time, uint32_t n);
+uint32_t win_get(const struct wincount *wc, uint32_t time, int w);
+
+#endif